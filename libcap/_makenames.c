@@ -7,6 +7,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/capability.h>
 
 /*
@@ -24,9 +25,65 @@ struct {
 /* this should be more than big enough (factor of three at least) */
 const char *pointers[8*sizeof(struct __user_cap_data_struct)];
 
+/*
+ * The name lookup hash is case-insensitive over [a-z_]. The step is
+ * written out verbatim into cap_names.h so the generated table and
+ * lookupname() can never disagree about it.
+ */
+#define HASH_STEP(h, c)  (((h) ^ ((c) | 0x20)) * 0x01000193U)
+#define STRINGIFY(x)     #x
+#define TO_STRING(x)     STRINGIFY(x)
+
+static unsigned char slots[1 << 16];
+
+static unsigned hash_name(const char *name, unsigned seed, unsigned bits)
+{
+    unsigned h = seed;
+    while (*name) {
+	h = HASH_STEP(h, (unsigned char) *name++);
+    }
+    return (h & 0xffffffffU) >> (32 - bits);
+}
+
+/*
+ * Search for a seed for which every named capability lands in its own
+ * slot. The table starts at four slots per name and doubles whenever
+ * a reasonable number of seeds fail to separate the names.
+ */
+static int perfect_hash(int maxcaps, unsigned *seed_p, unsigned *bits_p)
+{
+    unsigned bits, seed;
+    int i;
+
+    for (bits = 2; (1U << bits) < 4U*maxcaps; bits++);
+    for (; bits <= 16; bits++) {
+	for (seed = 0x811c9dc5U; seed != 0x811c9dc5U + (1U << 20); seed++) {
+	    memset(slots, 0, sizeof(slots));
+	    for (i = 0; i < maxcaps; i++) {
+		unsigned h;
+		if (pointers[i] == NULL) {
+		    continue;
+		}
+		h = hash_name(pointers[i], seed, bits);
+		if (slots[h]) {
+		    break;
+		}
+		slots[h] = i + 1;
+	    }
+	    if (i == maxcaps) {
+		*seed_p = seed;
+		*bits_p = bits;
+		return 0;
+	    }
+	}
+    }
+    return -1;
+}
+
 int main(void)
 {
     int i, maxcaps=0;
+    unsigned seed, bits;
 
     for ( i=0; list[i].index >= 0 && list[i].name; ++i ) {
 	if (maxcaps <= list[i].index) {
@@ -52,7 +109,23 @@ int main(void)
 	    printf("      /* %d */\tNULL,\t\t/* - presently unused */\n", i);
     }
 
+    if (maxcaps > 254 || perfect_hash(maxcaps, &seed, &bits)) {
+	fprintf(stderr, "unable to hash %d capability names\n", maxcaps);
+	exit(1);
+    }
+
     printf("  };\n"
+	   "\n"
+	   "  /* slot -> 1 + capability index, 0 for an empty slot */\n"
+	   "#define __CAP_NAME_HASH_BITS  %u\n"
+	   "#define __CAP_NAME_HASH_SEED  0x%08xU\n"
+	   "#define __CAP_NAME_HASH_STEP(h, c)  %s\n"
+	   "  static const unsigned char _cap_name_hash[1 << __CAP_NAME_HASH_BITS] = {",
+	   bits, seed, TO_STRING(HASH_STEP(h, c)));
+    for (i = 0; i < (1 << bits); ++i) {
+	printf("%s%3d,", (i % 16) ? " " : "\n      ", slots[i]);
+    }
+    printf("\n  };\n"
 	   "#endif /* LIBCAP_PLEASE_INCLUDE_ARRAY */\n"
 	   "\n"
 	   "/* END OF FILE */\n");
@@ -5,31 +5,425 @@
  * capability sets as specified by POSIX.1e (formerlly, POSIX 6).
  */
 
+#include <pthread.h>
+#include <sys/prctl.h>
+
 #include "libcap.h"
 
 /*
- * Obtain a blank set of capabilities
+ * The pool only needs thread-specific data to hand back the free
+ * list of an exiting thread. These are weak so that libcap does not
+ * force a dependency on -lpthread: without them, there is only one
+ * thread, and nothing to hand back before the process exits.
  */
+#pragma weak pthread_key_create
+#pragma weak pthread_setspecific
 
-cap_t cap_init(void)
+/*
+ * The capability ABI of the running kernel cannot change during the
+ * lifetime of a process, so it is probed once and cached. Allocating
+ * a cap_t thereafter never enters the kernel. The cache is
+ * immutable once probed, so a forked child simply inherits a valid
+ * copy. Concurrent first callers may probe in parallel, but they all
+ * store the same values, and readers only consult those values after
+ * observing the probed flag.
+ */
+static struct _cap_abi_s _cap_abi;
+static int _cap_abi_probed;
+
+static void _cap_probe_abi(void)
 {
-    __u32 *raw_data;
-    cap_t result;
+    struct __user_cap_header_struct head;
+    cap_value_t lo, hi;
+    unsigned u32s;
 
-    raw_data = calloc(1, sizeof(__u32) + sizeof(*result));
-    if (raw_data == NULL) {
-	_cap_debug("out of memory");
-	errno = ENOMEM;
-	return NULL;
+    head.version = _LIBCAP_CAPABILITY_VERSION;
+    head.pid = 0;
+    capget(&head, NULL);            /* load the kernel-capability version */
+
+    switch (head.version) {
+#ifdef _LINUX_CAPABILITY_VERSION_1
+    case _LINUX_CAPABILITY_VERSION_1:
+	u32s = _LINUX_CAPABILITY_U32S_1;
+	break;
+#endif
+#ifdef _LINUX_CAPABILITY_VERSION_2
+    case _LINUX_CAPABILITY_VERSION_2:
+	u32s = _LINUX_CAPABILITY_U32S_2;
+	break;
+#endif
+#ifdef _LINUX_CAPABILITY_VERSION_3
+    case _LINUX_CAPABILITY_VERSION_3:
+	u32s = _LINUX_CAPABILITY_U32S_3;
+	break;
+#endif
+    default:                        /* No idea what to do */
+	u32s = 0;
+	break;
+    }
+
+    /*
+     * Binary search for the first capability the kernel does not
+     * recognize. Kernels that predate the bounding set fail every
+     * probe, in which case we assume all of the named capabilities
+     * are supported.
+     */
+    if (prctl(PR_CAPBSET_READ, 0UL, 0UL, 0UL, 0UL) < 0) {
+	lo = __CAP_BITS;
+    } else {
+	lo = 1;
+	hi = __CAP_MAXBITS + 1;
+	while (hi - lo > 1) {
+	    cap_value_t mid = lo + (hi - lo) / 2;
+	    if (prctl(PR_CAPBSET_READ, (unsigned long) (mid - 1),
+		      0UL, 0UL, 0UL) < 0) {
+		hi = mid;
+	    } else {
+		lo = mid;
+	    }
+	}
+    }
+    if (lo > (cap_value_t) (32 * u32s)) {
+	lo = 32 * u32s;
     }
 
-    *raw_data = CAP_T_MAGIC;
-    result = (cap_t) (raw_data + 1);
+    __atomic_store_n(&_cap_abi.version, head.version, __ATOMIC_RELAXED);
+    __atomic_store_n(&_cap_abi.u32s, u32s, __ATOMIC_RELAXED);
+    __atomic_store_n(&_cap_abi.max_bits, lo, __ATOMIC_RELAXED);
+    __atomic_store_n(&_cap_abi_probed, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Return the cached kernel ABI, probing for it on first use.
+ */
 
-    result->head.version = _LIBCAP_CAPABILITY_VERSION;
-    capget(&result->head, NULL);      /* load the kernel-capability version */
+const struct _cap_abi_s *_libcap_abi(void)
+{
+    if (!__atomic_load_n(&_cap_abi_probed, __ATOMIC_ACQUIRE)) {
+	_cap_probe_abi();
+    }
+    return &_cap_abi;
+}
+
+/*
+ * Probe early so the common case, threaded or not, finds the cache
+ * already populated.
+ */
+__attribute__((constructor)) static void _initialize_libcap(void)
+{
+    (void) _libcap_abi();
+}
+
+/*
+ * Return the number of capability bits supported by the running
+ * kernel.
+ */
+
+cap_value_t cap_max_bits(void)
+{
+    return _libcap_abi()->max_bits;
+}
+
+/*
+ * Optional pooled allocation of cap_t values. Long running programs
+ * that churn through many short lived capability sets can opt into
+ * this with cap_pool_enable(). Sets are then carved from fixed size
+ * slabs that are never returned to the heap, and each thread keeps a
+ * private free list, so steady state allocation is a couple of
+ * pointer operations. Threads only contend on the shared depot when
+ * their private list runs dry, or overflows.
+ */
+
+#define CAP_POOL_SLAB_SETS    64  /* cap_t's carved from each slab */
+#define CAP_POOL_LOCAL_MAX   256  /* most idle sets kept by one thread */
+#define CAP_POOL_BATCH        32  /* sets moved to/from the depot at once */
+
+struct _cap_pool_list_s {
+    struct _cap_alloc_s *head;
+    unsigned count;
+};
+
+/*
+ * A thread's own state. Its counters are only written by the thread
+ * itself, so counting needs no atomic read-modify-write on a shared
+ * cache line; cap_pool_stats() sums them over the listed threads.
+ */
+struct _cap_pool_local_s {
+    struct _cap_pool_list_s list;
+    int registered;
+    int listed;                   /* on _cap_pool.threads */
+    unsigned long allocs, frees, local;
+    struct _cap_pool_local_s *prev, *next;
+};
+
+static struct {
+    int enabled;
+    __u8 mu;                      /* protects depot and threads */
+    struct _cap_pool_list_s depot;
+    struct _cap_pool_local_s *threads;
+    int key_state;                /* 0=unset, 1=creating, 2=ok, 3=failed */
+    pthread_key_t key;
+    int atfork;                   /* fork handlers registered */
+    unsigned long slabs;
+    unsigned long allocs, frees, local;  /* of threads not listed */
+} _cap_pool;
+
+static __thread struct _cap_pool_local_s _cap_pool_local;
+
+/*
+ * Count an event of the calling thread: in its own counters when it
+ * is listed (and so has an exit destructor to fold them back in),
+ * otherwise in the shared ones.
+ */
+#define _cap_pool_count(field)						\
+    do {								\
+	if (_cap_pool_local.listed) {					\
+	    __atomic_store_n(&_cap_pool_local.field,			\
+			     _cap_pool_local.field + 1, __ATOMIC_RELAXED); \
+	} else {							\
+	    __atomic_fetch_add(&_cap_pool.field, 1, __ATOMIC_RELAXED);	\
+	}								\
+    } while (0)
+
+static void _cap_pool_push(struct _cap_pool_list_s *list,
+			   struct _cap_alloc_s *alloc)
+{
+    alloc->u.next = list->head;
+    list->head = alloc;
+    list->count++;
+}
+
+static struct _cap_alloc_s *_cap_pool_pop(struct _cap_pool_list_s *list)
+{
+    struct _cap_alloc_s *alloc = list->head;
+
+    if (alloc != NULL) {
+	list->head = alloc->u.next;
+	list->count--;
+    }
+    return alloc;
+}
+
+/*
+ * Move up to n sets from one list to another.
+ */
+static void _cap_pool_move(struct _cap_pool_list_s *to,
+			   struct _cap_pool_list_s *from, unsigned n)
+{
+    struct _cap_alloc_s *alloc;
+
+    while (n-- && (alloc = _cap_pool_pop(from)) != NULL) {
+	_cap_pool_push(to, alloc);
+    }
+}
+
+/*
+ * Thread exit destructor: return the thread's idle sets to the depot,
+ * and fold its counters into the shared ones.
+ */
+static void _cap_pool_release(void *ignored)
+{
+    struct _cap_pool_local_s *local = &_cap_pool_local;
+
+    _cap_mu_lock(&_cap_pool.mu);
+    _cap_pool_move(&_cap_pool.depot, &local->list, ~0U);
+    if (local->listed) {
+	if (local->prev != NULL) {
+	    local->prev->next = local->next;
+	} else {
+	    _cap_pool.threads = local->next;
+	}
+	if (local->next != NULL) {
+	    local->next->prev = local->prev;
+	}
+	__atomic_fetch_add(&_cap_pool.allocs, local->allocs, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&_cap_pool.frees, local->frees, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&_cap_pool.local, local->local, __ATOMIC_RELAXED);
+	local->allocs = local->frees = local->local = 0;
+	local->listed = 0;
+    }
+    _cap_mu_unlock(&_cap_pool.mu);
+    local->registered = 0;
+}
+
+/*
+ * Arrange for this thread's free list to be released when it exits.
+ */
+static void _cap_pool_register(void)
+{
+    int state;
+
+    _cap_pool_local.registered = 1;
+    if (pthread_key_create == NULL || pthread_setspecific == NULL) {
+	return;
+    }
+
+    state = 0;
+    if (__atomic_compare_exchange_n(&_cap_pool.key_state, &state, 1, 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	state = pthread_key_create(&_cap_pool.key, _cap_pool_release)
+	    ? 3 : 2;
+	__atomic_store_n(&_cap_pool.key_state, state, __ATOMIC_RELEASE);
+    }
+    while (state == 1) {
+	sched_yield();
+	state = __atomic_load_n(&_cap_pool.key_state, __ATOMIC_ACQUIRE);
+    }
+    if (state == 2
+	&& pthread_setspecific(_cap_pool.key, &_cap_pool_local) == 0) {
+	struct _cap_pool_local_s *local = &_cap_pool_local;
 
-    switch (result->head.version) {
+	_cap_mu_lock(&_cap_pool.mu);
+	local->prev = NULL;
+	local->next = _cap_pool.threads;
+	if (local->next != NULL) {
+	    local->next->prev = local;
+	}
+	_cap_pool.threads = local;
+	local->listed = 1;
+	_cap_mu_unlock(&_cap_pool.mu);
+    }
+}
+
+static struct _cap_alloc_s *_cap_pool_get(void)
+{
+    struct _cap_alloc_s *alloc;
+
+    if (!_cap_pool_local.registered) {
+	_cap_pool_register();
+    }
+
+    alloc = _cap_pool_pop(&_cap_pool_local.list);
+    if (alloc != NULL) {
+	_cap_pool_count(local);
+    } else {
+	_cap_mu_lock(&_cap_pool.mu);
+	_cap_pool_move(&_cap_pool_local.list, &_cap_pool.depot,
+		       CAP_POOL_BATCH);
+	_cap_mu_unlock(&_cap_pool.mu);
+	alloc = _cap_pool_pop(&_cap_pool_local.list);
+    }
+
+    if (alloc == NULL) {
+	struct _cap_alloc_s *slab;
+	unsigned i;
+
+	slab = calloc(CAP_POOL_SLAB_SETS, sizeof(*slab));
+	if (slab == NULL) {
+	    return NULL;
+	}
+	__atomic_fetch_add(&_cap_pool.slabs, 1, __ATOMIC_RELAXED);
+	for (i = 1; i < CAP_POOL_SLAB_SETS; i++) {
+	    slab[i].origin = _CAP_ALLOC_POOL;
+	    _cap_pool_push(&_cap_pool_local.list, &slab[i]);
+	}
+	alloc = &slab[0];
+	alloc->origin = _CAP_ALLOC_POOL;
+    }
+
+    memset(&alloc->u, 0, sizeof(alloc->u));
+    _cap_pool_count(allocs);
+
+    return alloc;
+}
+
+static void _cap_pool_put(struct _cap_alloc_s *alloc)
+{
+    memset(alloc, 0, sizeof(*alloc));
+    alloc->origin = _CAP_ALLOC_POOL;
+
+    if (!_cap_pool_local.registered) {
+	_cap_pool_register();
+    }
+    _cap_pool_count(frees);
+
+    _cap_pool_push(&_cap_pool_local.list, alloc);
+    if (_cap_pool_local.list.count > CAP_POOL_LOCAL_MAX) {
+	_cap_mu_lock(&_cap_pool.mu);
+	_cap_pool_move(&_cap_pool.depot, &_cap_pool_local.list,
+		       CAP_POOL_BATCH);
+	_cap_mu_unlock(&_cap_pool.mu);
+    }
+}
+
+/*
+ * The depot lock is held across fork() so the child never inherits
+ * it locked, or the depot half updated, by some other thread. The
+ * child's copy of the lock is simply reset.
+ */
+static void _cap_pool_prefork(void)
+{
+    _cap_mu_lock(&_cap_pool.mu);
+}
+
+static void _cap_pool_postfork_parent(void)
+{
+    _cap_mu_unlock(&_cap_pool.mu);
+}
+
+static void _cap_pool_postfork_child(void)
+{
+    _cap_pool.mu = 0;
+}
+
+/*
+ * Select whether cap_init() (and everything that allocates a cap_t)
+ * draws from the pool. Sets allocated before a change of mode are
+ * still liberated correctly by cap_free(). Returns the previous mode.
+ */
+
+int cap_pool_enable(int enable)
+{
+    if (enable
+	&& !__atomic_exchange_n(&_cap_pool.atfork, 1, __ATOMIC_ACQ_REL)) {
+	(void) pthread_atfork(_cap_pool_prefork, _cap_pool_postfork_parent,
+			      _cap_pool_postfork_child);
+    }
+    return __atomic_exchange_n(&_cap_pool.enabled, !!enable,
+			       __ATOMIC_RELAXED);
+}
+
+/*
+ * Report the pool's allocation counters.
+ */
+
+int cap_pool_stats(cap_pool_stats_t *stats)
+{
+    struct _cap_pool_local_s *local;
+
+    if (stats == NULL) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    _cap_mu_lock(&_cap_pool.mu);
+    stats->slabs = __atomic_load_n(&_cap_pool.slabs, __ATOMIC_RELAXED);
+    stats->allocs = __atomic_load_n(&_cap_pool.allocs, __ATOMIC_RELAXED);
+    stats->frees = __atomic_load_n(&_cap_pool.frees, __ATOMIC_RELAXED);
+    stats->local = __atomic_load_n(&_cap_pool.local, __ATOMIC_RELAXED);
+    for (local = _cap_pool.threads; local != NULL; local = local->next) {
+	stats->allocs += __atomic_load_n(&local->allocs, __ATOMIC_RELAXED);
+	stats->frees += __atomic_load_n(&local->frees, __ATOMIC_RELAXED);
+	stats->local += __atomic_load_n(&local->local, __ATOMIC_RELAXED);
+    }
+    _cap_mu_unlock(&_cap_pool.mu);
+    stats->in_use = stats->allocs - stats->frees;
+
+    return 0;
+}
+
+/*
+ * Obtain a blank set of capabilities
+ */
+
+cap_t cap_init(void)
+{
+    struct _cap_alloc_s *alloc;
+    cap_t result;
+    __u32 version;
+
+    version = _libcap_abi()->version;
+    switch (version) {
 #ifdef _LINUX_CAPABILITY_VERSION_1
     case _LINUX_CAPABILITY_VERSION_1:
 	break;
@@ -43,11 +437,56 @@ cap_t cap_init(void)
 	break;
 #endif
     default:                          /* No idea what to do */
-	cap_free(result);
-	result = NULL;
-	break;
+	_cap_debug("unsupported kernel capability version");
+	errno = EINVAL;
+	return NULL;
     }
 
+    if (__atomic_load_n(&_cap_pool.enabled, __ATOMIC_RELAXED)) {
+	alloc = _cap_pool_get();
+    } else {
+	alloc = calloc(1, sizeof(*alloc));
+    }
+    if (alloc == NULL) {
+	_cap_debug("out of memory");
+	errno = ENOMEM;
+	return NULL;
+    }
+
+    alloc->magic = CAP_T_MAGIC;
+    result = &alloc->u.set;
+    result->head.version = version;
+
+    return result;
+}
+
+/*
+ * Obtain a blank set of capabilities that lives in caller provided
+ * storage. Nothing is allocated, and once the ABI has been probed no
+ * system call is made, so this is suited to decoding capability sets
+ * in bulk. cap_free() of the result scrubs, but does not liberate,
+ * the storage.
+ */
+
+typedef char _cap_storage_is_big_enough
+	[sizeof(cap_storage_t) >= sizeof(struct _cap_alloc_s) ? 1 : -1];
+
+cap_t cap_init_storage(cap_storage_t *storage)
+{
+    struct _cap_alloc_s *alloc = (struct _cap_alloc_s *) storage;
+    cap_t result;
+
+    if (storage == NULL) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    memset(alloc, 0, sizeof(*alloc));
+    alloc->origin = _CAP_ALLOC_STORAGE;
+    alloc->magic = CAP_T_MAGIC;
+    result = &alloc->u.set;
+    result->head.version = _libcap_abi()->version;
+
     return result;
 }
 
@@ -115,13 +554,35 @@ int cap_free(void *data_p)
 	return 0;
 
     if ( good_cap_t(data_p) ) {
-	data_p = -1 + (__u32 *) data_p;
-	memset(data_p, 0, sizeof(__u32) + sizeof(struct _cap_struct));
-	free(data_p);
+	struct _cap_alloc_s *alloc = cap_t_alloc(data_p);
+
+	switch (alloc->origin) {
+	case _CAP_ALLOC_POOL:
+	    _cap_pool_put(alloc);
+	    break;
+	case _CAP_ALLOC_STORAGE:
+	    memset(alloc, 0, sizeof(*alloc));
+	    break;
+	default:
+	    memset(alloc, 0, sizeof(*alloc));
+	    free(alloc);
+	    break;
+	}
 	data_p = NULL;
 	return 0;
     }
 
+    if ( good_cap_launch(data_p) ) {
+	struct cap_launch_s *attr = data_p;
+	struct _cap_launch_alloc_s *alloc = (struct _cap_launch_alloc_s *)
+	    (((char *) attr) - offsetof(struct _cap_launch_alloc_s, launch));
+
+	free(attr->groups);
+	memset(alloc, 0, sizeof(*alloc));
+	free(alloc);
+	return 0;
+    }
+
     if ( good_cap_string(data_p) ) {
 	size_t length = strlen(data_p) + sizeof(__u32);
      	data_p = -1 + (__u32 *) data_p;
@@ -75,28 +75,23 @@ ssize_t cap_copy_ext(void *cap_ext, cap_t cap_d, ssize_t length)
 }
 
 /*
- * Import an external representation to produce an internal rep.
- * the internal rep should be liberated with cap_free().
+ * Import an external representation into an existing internal rep,
+ * replacing its content. No memory is allocated.
  */
 
-cap_t cap_copy_int(const void *cap_ext)
+int cap_copy_int_into(cap_t cap_d, const void *cap_ext)
 {
     const struct cap_ext_struct *export =
 	(const struct cap_ext_struct *) cap_ext;
-    cap_t cap_d;
     int set, blen;
 
     /* Does the external representation make sense? */
-    if ((export == NULL)
+    if (!good_cap_t(cap_d) || (export == NULL)
 	|| memcmp(export->magic, external_magic, CAP_EXT_MAGIC_SIZE)) {
 	errno = EINVAL;
-	return NULL;
+	return -1;
     }
 
-    /* Obtain a new internal capability set */
-    if (!(cap_d = cap_init()))
-       return NULL;
-
     blen = export->length_of_capset;
     for (set=0; set<NUMBER_OF_CAP_SETS; ++set) {
 	unsigned blk;
@@ -116,8 +111,36 @@ cap_t cap_copy_int(const void *cap_ext)
 	    cap_d->u[blk].flat[set] = val;
 	}
     }
+    cap_d->rootid = 0;
+
+    return 0;
+}
+
+/*
+ * Import an external representation to produce an internal rep.
+ * the internal rep should be liberated with cap_free().
+ */
+
+cap_t cap_copy_int(const void *cap_ext)
+{
+    cap_t cap_d;
+
+    /* Does the external representation make sense? */
+    if ((cap_ext == NULL)
+	|| memcmp(cap_ext, external_magic, CAP_EXT_MAGIC_SIZE)) {
+	errno = EINVAL;
+	return NULL;
+    }
+
+    /* Obtain a new internal capability set */
+    if (!(cap_d = cap_init()))
+       return NULL;
+
+    if (cap_copy_int_into(cap_d, cap_ext) != 0) {
+	cap_free(cap_d);
+	return NULL;
+    }
 
     /* all done */
     return cap_d;
 }
-
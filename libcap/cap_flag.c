@@ -148,3 +148,184 @@ int cap_compare(cap_t a, cap_t b)
     }
     return result;
 }
+
+/*
+ * Whole-word set algebra. Each of these combines the capabilities of
+ * src into dst, in place, for all of the flag sets at once.
+ */
+
+#define CAP_OP_UNION      0
+#define CAP_OP_INTERSECT  1
+#define CAP_OP_DIFF       2
+#define CAP_OP_XOR        3
+
+static int _cap_combine(cap_t dst, cap_t src, int op)
+{
+    unsigned i, f;
+
+    if (!(good_cap_t(dst) && good_cap_t(src))) {
+	_cap_debug("invalid arguments");
+	errno = EINVAL;
+	return -1;
+    }
+
+    for (i=0; i<_LIBCAP_CAPABILITY_U32S; i++) {
+	for (f=0; f<NUMBER_OF_CAP_SETS; f++) {
+	    __u32 s = src->u[i].flat[f];
+
+	    switch (op) {
+	    case CAP_OP_UNION:
+		dst->u[i].flat[f] |= s;
+		break;
+	    case CAP_OP_INTERSECT:
+		dst->u[i].flat[f] &= s;
+		break;
+	    case CAP_OP_DIFF:
+		dst->u[i].flat[f] &= ~s;
+		break;
+	    case CAP_OP_XOR:
+		dst->u[i].flat[f] ^= s;
+		break;
+	    }
+	}
+    }
+    return 0;
+}
+
+/*
+ * dst gains every capability raised in src
+ */
+
+int cap_union(cap_t dst, cap_t src)
+{
+    return _cap_combine(dst, src, CAP_OP_UNION);
+}
+
+/*
+ * dst keeps only the capabilities also raised in src
+ */
+
+int cap_intersect(cap_t dst, cap_t src)
+{
+    return _cap_combine(dst, src, CAP_OP_INTERSECT);
+}
+
+/*
+ * dst loses every capability raised in src
+ */
+
+int cap_diff(cap_t dst, cap_t src)
+{
+    return _cap_combine(dst, src, CAP_OP_DIFF);
+}
+
+/*
+ * dst toggles every capability raised in src
+ */
+
+int cap_xor(cap_t dst, cap_t src)
+{
+    return _cap_combine(dst, src, CAP_OP_XOR);
+}
+
+/*
+ * dst gains the capabilities raised in one flag set of src. The other
+ * flag sets of dst are left untouched.
+ */
+
+int cap_merge_flag(cap_t dst, cap_t src, cap_flag_t flag)
+{
+    switch (flag) {
+    case CAP_EFFECTIVE:
+    case CAP_PERMITTED:
+    case CAP_INHERITABLE:
+	if (good_cap_t(dst) && good_cap_t(src)) {
+	    unsigned i;
+
+	    for (i=0; i<_LIBCAP_CAPABILITY_U32S; i++) {
+		dst->u[i].flat[flag] |= src->u[i].flat[flag];
+	    }
+	    return 0;
+	}
+	/*
+	 * fall through
+	 */
+
+    default:
+	_cap_debug("invalid arguments");
+	errno = EINVAL;
+	return -1;
+    }
+}
+
+/*
+ * Obtain one flag of a capability set as a 64-bit mask, bit n standing
+ * for capability n.
+ */
+
+int cap_get_mask(cap_t cap_d, cap_flag_t flag, uint64_t *mask)
+{
+    unsigned i;
+
+    if (!(mask && good_cap_t(cap_d) && flag >= 0
+	  && flag < NUMBER_OF_CAP_SETS)) {
+	_cap_debug("invalid arguments");
+	errno = EINVAL;
+	return -1;
+    }
+
+    *mask = 0;
+    for (i = 0; i < _LIBCAP_CAPABILITY_U32S && i < 2; i++) {
+	*mask |= ((uint64_t) cap_d->u[i].flat[flag]) << (32 * i);
+    }
+    return 0;
+}
+
+/*
+ * Replace one flag of a capability set with the bits of a 64-bit mask.
+ */
+
+int cap_set_mask(cap_t cap_d, cap_flag_t flag, uint64_t mask)
+{
+    unsigned i;
+
+    if (!(good_cap_t(cap_d) && flag >= 0 && flag < NUMBER_OF_CAP_SETS)) {
+	_cap_debug("invalid arguments");
+	errno = EINVAL;
+	return -1;
+    }
+
+    for (i = 0; i < _LIBCAP_CAPABILITY_U32S; i++) {
+	cap_d->u[i].flat[flag] = i < 2 ? (__u32) (mask >> (32 * i)) : 0;
+    }
+    return 0;
+}
+
+/*
+ * Return the lowest capability, no smaller than from, that is raised
+ * in a flag of a capability set. Returns -1 once there are no more.
+ */
+
+cap_value_t cap_next_raised(cap_t cap_d, cap_flag_t flag, cap_value_t from)
+{
+    unsigned i;
+
+    if (!(good_cap_t(cap_d) && flag >= 0 && flag < NUMBER_OF_CAP_SETS
+	  && from >= 0)) {
+	_cap_debug("invalid arguments");
+	errno = EINVAL;
+	return -1;
+    }
+
+    for (i = from >> 5; i < _LIBCAP_CAPABILITY_U32S; i++) {
+	__u32 bits = cap_d->u[i].flat[flag];
+
+	if (i == (unsigned) from >> 5) {
+	    bits &= ~0U << (from & 31);
+	}
+	if (bits) {
+	    return 32 * i + __builtin_ctz(bits);
+	}
+    }
+    return -1;
+}
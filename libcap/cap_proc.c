@@ -4,10 +4,16 @@
  * This file deals with getting and setting capabilities on processes.
  */
 
+#define _GNU_SOURCE
 #include <sys/syscall.h>
 #include <sys/prctl.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
 
+#include <sys/psx_syscall.h>
+
 #include "libcap.h"
 
 /*
@@ -35,6 +41,31 @@ static long int (*_libcap_syscall)(long int, long int, long int, long int)
 static long int (*_libcap_syscall6)(long int, long int, long int, long int,
     long int, long int, long int) = _cap_syscall6;
 
+/*
+ * Sequences of state changing system calls go through
+ * _libcap_syscall_batch. Unless libpsx supplies psx_syscall_batch(),
+ * the steps are simply made one after another via _libcap_syscall6,
+ * stopping at the first failure.
+ */
+static int _cap_syscall_batch(psx_step_t *steps, int n)
+{
+    for (int i = 0; i < n; i++) {
+	psx_step_t *step = &steps[i];
+
+	step->ret = _libcap_syscall6(step->syscall_nr,
+				     step->arg[0], step->arg[1], step->arg[2],
+				     step->arg[3], step->arg[4], step->arg[5]);
+	step->err = step->ret == -1 ? errno : 0;
+	if (step->err) {
+	    errno = step->err;
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+static int (*_libcap_syscall_batch)(psx_step_t *, int) = _cap_syscall_batch;
+
 void cap_set_syscall(long int (*new_syscall)(long int,
 					     long int, long int, long int),
 		     long int (*new_syscall6)(long int,
@@ -43,6 +74,7 @@ void cap_set_syscall(long int (*new_syscall)(long int,
 {
     _libcap_syscall = new_syscall;
     _libcap_syscall6 = new_syscall6;
+    _libcap_syscall_batch = _cap_syscall_batch;
 }
 
 /*
@@ -66,6 +98,77 @@ void share_psx_syscall(long int (*syscall_fn)(long int,
     cap_set_syscall(syscall_fn, syscall6_fn);
 }
 
+void share_psx_syscall_batch(int (*batch_fn)(psx_step_t *steps, int n))
+{
+    _libcap_syscall_batch = batch_fn;
+}
+
+/*
+ * _libcap_run_steps makes all of the steps, in order, through as few
+ * _libcap_syscall_batch calls as possible: a failed step is recorded
+ * and the batch resumes with the step after it. If a batch fails as a
+ * whole, without any step recording an error, none of its steps is
+ * known to have run: all of them are marked with errno and nothing
+ * more is attempted. The steps must start out with a zero err field.
+ * The return value is 0 if every step succeeded, otherwise -1 with
+ * errno set by the first failure.
+ */
+static int _libcap_run_steps(psx_step_t *steps, int n)
+{
+    int err = 0;
+
+    while (n > 0 && _libcap_syscall_batch(steps, n) != 0) {
+	int failed = 0;
+
+	while (failed < n && steps[failed].err == 0) {
+	    failed++;
+	}
+	if (failed == n) {
+	    int batch_err = errno ? errno : EINVAL;
+
+	    while (failed-- > 0) {
+		steps[failed].err = batch_err;
+	    }
+	    if (!err) {
+		err = batch_err;
+	    }
+	    break;
+	}
+	if (!err) {
+	    err = steps[failed].err;
+	}
+	steps += failed + 1;
+	n -= failed + 1;
+    }
+    if (err) {
+	errno = err;
+	return -1;
+    }
+    return 0;
+}
+
+/* fill in a capset() step */
+static void _libcap_capset_step(psx_step_t *step, cap_user_header_t header,
+				const cap_user_data_t data)
+{
+    memset(step, 0, sizeof(*step));
+    step->syscall_nr = SYS_capset;
+    step->arg[0] = (long int) header;
+    step->arg[1] = (long int) data;
+}
+
+/* fill in a prctl() step */
+static void _libcap_prctl_step(psx_step_t *step, long int pr_cmd,
+			       long int arg1, long int arg2, long int arg3)
+{
+    memset(step, 0, sizeof(*step));
+    step->syscall_nr = SYS_prctl;
+    step->arg[0] = pr_cmd;
+    step->arg[1] = arg1;
+    step->arg[2] = arg2;
+    step->arg[3] = arg3;
+}
+
 static int _libcap_capset(cap_user_header_t header, const cap_user_data_t data)
 {
     return _libcap_syscall(SYS_capset, (long int) header, (long int) data, 0);
@@ -213,6 +316,57 @@ int cap_drop_bound(cap_value_t cap)
     return result;
 }
 
+/*
+ * drop a set of capabilities from the bounding set: CAP_SETPCAP is
+ * raised (if need be) once for all of them, and the original state is
+ * restored afterwards. Every requested capability is attempted; the
+ * first failure is reported.
+ */
+
+int cap_drop_bound_mask(uint64_t drop)
+{
+    struct __user_cap_header_struct head;
+    struct __user_cap_data_struct orig[_LIBCAP_CAPABILITY_U32S];
+    struct __user_cap_data_struct raised[_LIBCAP_CAPABILITY_U32S];
+    psx_step_t steps[64 + 2], *step = steps;
+    cap_value_t max = cap_max_bits();
+    int restore = 0;
+
+    if (max < 64) {
+	drop &= (1ULL << max) - 1;
+    }
+    if (drop == 0) {
+	return 0;
+    }
+
+    memset(orig, 0, sizeof(orig));
+    head.version = _libcap_abi()->version;
+    head.pid = 0;
+    if (capget(&head, orig) != 0) {
+	return -1;
+    }
+    if (!(orig[CAP_TO_INDEX(CAP_SETPCAP)].effective
+	  & CAP_TO_MASK(CAP_SETPCAP))) {
+	memcpy(raised, orig, sizeof(raised));
+	raised[CAP_TO_INDEX(CAP_SETPCAP)].effective |= CAP_TO_MASK(CAP_SETPCAP);
+	_libcap_capset_step(step++, &head, raised);
+	restore = 1;
+    }
+
+    while (drop) {
+	cap_value_t cap = __builtin_ctzll(drop);
+
+	drop &= drop - 1;
+	_libcap_prctl_step(step++, PR_CAPBSET_DROP, pr_arg(cap), pr_arg(0),
+			   pr_arg(0));
+    }
+
+    if (restore) {
+	_libcap_capset_step(step++, &head, orig);
+    }
+    return _libcap_run_steps(steps, step - steps);
+}
+
 /* get a capability from the ambient set */
 
 int cap_get_ambient(cap_value_t cap)
@@ -252,6 +406,84 @@ int cap_set_ambient(cap_value_t cap, cap_flag_value_t set)
     return result;
 }
 
+/*
+ * apply a delta to the ambient set: the capabilities in lower are
+ * lowered, then those in raise are raised. Neither needs CAP_SETPCAP:
+ * a capability can be raised if it is both permitted and inheritable,
+ * and lowered unconditionally. Capabilities already in the requested
+ * state are left alone. The return value is the mask of the
+ * capabilities that could not be changed (0 for complete success),
+ * and errno describes the first of these.
+ */
+
+uint64_t cap_set_ambient_mask(uint64_t raise, uint64_t lower)
+{
+    cap_snapshot_t snap;
+    psx_step_t steps[64 + 1], *step = steps;
+    cap_value_t max = cap_max_bits();
+    uint64_t failed = 0, supported = ~0ULL, cleared = 0;
+    int err = 0;
+
+    if (max < 64) {
+	supported = (1ULL << max) - 1;
+    }
+    failed = (raise | lower) & ~supported;
+    if (failed) {
+	err = EINVAL;
+    }
+    raise &= supported;
+    lower &= supported & ~raise;
+
+    if (cap_get_snapshot(0, &snap) == 0
+	&& (snap.valid & CAP_SNAPSHOT_AMBIENT)) {
+	raise &= ~snap.ambient;
+	lower &= snap.ambient;
+	if (lower != 0 && lower == snap.ambient && (lower & (lower - 1))) {
+	    /* everything goes */
+	    _libcap_prctl_step(step++, PR_CAP_AMBIENT,
+			       pr_arg(PR_CAP_AMBIENT_CLEAR_ALL), pr_arg(0),
+			       pr_arg(0));
+	    cleared = lower;
+	    lower = 0;
+	}
+    }
+
+    while (lower | raise) {
+	uint64_t bits = lower ? lower : raise;
+	cap_value_t cap = __builtin_ctzll(bits);
+	long int op = lower ? PR_CAP_AMBIENT_LOWER : PR_CAP_AMBIENT_RAISE;
+
+	if (lower) {
+	    lower &= lower - 1;
+	} else {
+	    raise &= raise - 1;
+	}
+	_libcap_prctl_step(step++, PR_CAP_AMBIENT, pr_arg(op), pr_arg(cap),
+			   pr_arg(0));
+    }
+
+    if (_libcap_run_steps(steps, step - steps) != 0) {
+	if (!failed) {
+	    err = errno;
+	}
+	while (step-- != steps) {
+	    if (step->err == 0) {
+		continue;
+	    }
+	    if (step->arg[1] == PR_CAP_AMBIENT_CLEAR_ALL) {
+		failed |= cleared;
+	    } else {
+		failed |= 1ULL << step->arg[2];
+	    }
+	}
+    }
+
+    if (failed) {
+	errno = err;
+    }
+    return failed;
+}
+
 /* erase all ambient capabilities */
 
 int cap_reset_ambient()
@@ -266,3 +498,442 @@ int cap_reset_ambient()
     }
     return result;
 }
+
+/*
+ * The capability state of a process, as reported in its status file:
+ *
+ *   CapInh:\t0000000000000000
+ *   ...
+ *   NoNewPrivs:\t0
+ */
+
+static const char *_cap_status_hex(const char *p, const char *end,
+				   uint64_t *value)
+{
+    uint64_t v = 0;
+
+    while (p < end && (*p == ' ' || *p == '\t')) {
+	p++;
+    }
+    for (; p < end; p++) {
+	unsigned d = (unsigned char) *p - '0';
+
+	if (d > 9) {
+	    d = ((unsigned char) *p | 0x20) - 'a';
+	    if (d > 5) {
+		break;
+	    }
+	    d += 10;
+	}
+	v = (v << 4) | d;
+    }
+    *value = v;
+    return p;
+}
+
+static void _cap_status_line(cap_snapshot_t *snap, const char *line,
+			     const char *end, unsigned *seen)
+{
+    uint64_t value;
+
+    if (end - line > 7 && line[0] == 'C' && line[1] == 'a'
+	&& line[2] == 'p' && line[6] == ':') {
+	uint64_t *field;
+	unsigned bit;
+
+	switch (line[3]) {
+	case 'I':
+	    field = &snap->inheritable;
+	    bit = 1;
+	    break;
+	case 'P':
+	    field = &snap->permitted;
+	    bit = 2;
+	    break;
+	case 'E':
+	    field = &snap->effective;
+	    bit = 4;
+	    break;
+	case 'B':
+	    field = &snap->bounding;
+	    bit = 8;
+	    break;
+	case 'A':
+	    field = &snap->ambient;
+	    bit = 16;
+	    break;
+	default:
+	    return;
+	}
+	_cap_status_hex(line + 7, end, field);
+	*seen |= bit;
+    } else if (end - line > 11 && !memcmp(line, "NoNewPrivs:", 11)) {
+	_cap_status_hex(line + 11, end, &value);
+	snap->no_new_privs = value != 0;
+	*seen |= 32;
+    }
+}
+
+/*
+ * Fill in a snapshot of the capability state of process pid, or of the
+ * calling thread when pid is 0, from a single read of its status file.
+ * Only the calling thread's securebits are available.
+ */
+int cap_get_snapshot(pid_t pid, cap_snapshot_t *snap)
+{
+    char buf[1024], path[64];
+    size_t have = 0;
+    unsigned seen = 0;
+    int fd, skipping = 0, err = 0, result;
+
+    if (snap == NULL || pid < 0) {
+	errno = EINVAL;
+	return -1;
+    }
+    memset(snap, 0, sizeof(*snap));
+
+    if (pid == 0) {
+	/* capabilities are a property of each thread */
+	snprintf(path, sizeof(path), "/proc/self/task/%ld/status",
+		 (long) syscall(SYS_gettid));
+    } else {
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    }
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) {
+	return -1;
+    }
+
+    for (;;) {
+	ssize_t n = read(fd, buf + have, sizeof(buf) - have);
+	char *line, *end;
+
+	if (n < 0 && errno == EINTR) {
+	    continue;
+	}
+	if (n <= 0) {
+	    err = n < 0 ? errno : 0;
+	    break;
+	}
+	have += n;
+	for (line = buf; (end = memchr(line, '\n', buf + have - line));
+	     line = end + 1) {
+	    if (!skipping) {
+		_cap_status_line(snap, line, end, &seen);
+	    }
+	    skipping = 0;
+	}
+	have -= line - buf;
+	if (have == sizeof(buf)) {
+	    /* a long (Groups:) line of no interest */
+	    skipping = 1;
+	    have = 0;
+	} else {
+	    memmove(buf, line, have);
+	}
+    }
+    close(fd);
+
+    if ((seen & 7) != 7) {
+	/* a kernel too old to report them */
+	errno = err ? err : ENOSYS;
+	return -1;
+    }
+    snap->valid = CAP_SNAPSHOT_IPE;
+    if (seen & 8) {
+	snap->valid |= CAP_SNAPSHOT_BOUNDING;
+    }
+    if (seen & 16) {
+	snap->valid |= CAP_SNAPSHOT_AMBIENT;
+    }
+    if (seen & 32) {
+	snap->valid |= CAP_SNAPSHOT_NO_NEW_PRIVS;
+    }
+
+    if (pid == 0) {
+	result = _libcap_prctl(PR_GET_SECUREBITS, pr_arg(0), pr_arg(0));
+	if (result >= 0) {
+	    snap->securebits = result;
+	    snap->valid |= CAP_SNAPSHOT_SECUREBITS;
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * cap_launch() starts a program with modified credentials. The child
+ * shares the memory of the caller (clone(CLONE_VM|CLONE_VFORK)), so
+ * no page tables are copied, and the caller is suspended until the
+ * child has called execve() or exited. The child runs on its own
+ * stack, uses raw system calls only (libc's setuid() and friends, and
+ * any libpsx hook, act on every thread of the parent), and reports a
+ * failure by writing its errno to a close-on-exec pipe.
+ */
+
+#ifdef SYS_setresuid32
+# define _CAP_SYS_SETGROUPS SYS_setgroups32
+# define _CAP_SYS_SETRESGID SYS_setresgid32
+# define _CAP_SYS_SETRESUID SYS_setresuid32
+#else
+# define _CAP_SYS_SETGROUPS SYS_setgroups
+# define _CAP_SYS_SETRESGID SYS_setresgid
+# define _CAP_SYS_SETRESUID SYS_setresuid
+#endif
+
+#define _CAP_LAUNCH_STACK (64 * 1024)
+
+cap_launch_t cap_new_launcher(const char *arg0, const char * const *argv,
+			      const char * const *envp)
+{
+    struct _cap_launch_alloc_s *alloc;
+
+    if (arg0 == NULL || argv == NULL) {
+	errno = EINVAL;
+	return NULL;
+    }
+    alloc = calloc(1, sizeof(*alloc));
+    if (alloc == NULL) {
+	return NULL;
+    }
+    alloc->magic = CAP_LAUNCH_MAGIC;
+    alloc->launch.arg0 = arg0;
+    alloc->launch.argv = argv;
+    alloc->launch.envp = envp;
+
+    return &alloc->launch;
+}
+
+int cap_launcher_setuid(cap_launch_t attr, uid_t uid)
+{
+    if (!good_cap_launch(attr)) {
+	errno = EINVAL;
+	return -1;
+    }
+    attr->change_uids = 1;
+    attr->uid = uid;
+    return 0;
+}
+
+int cap_launcher_setgroups(cap_launch_t attr, gid_t gid, int ngroups,
+			   const gid_t *groups)
+{
+    gid_t *copy = NULL;
+
+    if (!good_cap_launch(attr) || ngroups < 0
+	|| (ngroups > 0 && groups == NULL)) {
+	errno = EINVAL;
+	return -1;
+    }
+    if (ngroups > 0) {
+	copy = malloc(ngroups * sizeof(gid_t));
+	if (copy == NULL) {
+	    return -1;
+	}
+	memcpy(copy, groups, ngroups * sizeof(gid_t));
+    }
+    free(attr->groups);
+    attr->change_gids = 1;
+    attr->gid = gid;
+    attr->ngroups = ngroups;
+    attr->groups = copy;
+    return 0;
+}
+
+/*
+ * The launched program gets these inheritable and ambient sets, and
+ * the bound_drop capabilities are dropped from its bounding set.
+ */
+int cap_launcher_set_iab(cap_launch_t attr, uint64_t inheritable,
+			 uint64_t ambient, uint64_t bound_drop)
+{
+    if (!good_cap_launch(attr) || (ambient & ~inheritable)) {
+	errno = EINVAL;
+	return -1;
+    }
+    attr->change_iab = 1;
+    attr->inheritable = inheritable;
+    attr->ambient = ambient;
+    attr->bound_drop = bound_drop;
+    return 0;
+}
+
+int cap_launcher_set_secbits(cap_launch_t attr, unsigned bits)
+{
+    if (!good_cap_launch(attr)) {
+	errno = EINVAL;
+	return -1;
+    }
+    attr->change_secbits = 1;
+    attr->secbits = bits;
+    return 0;
+}
+
+struct _cap_launch_ctx_s {
+    const struct cap_launch_s *attr;
+    int report;                  /* write end of the error pipe */
+    sigset_t mask;               /* the caller's signal mask */
+    struct __user_cap_header_struct head;
+    struct __user_cap_data_struct data[_LIBCAP_CAPABILITY_U32S];
+};
+
+static int _cap_launch_fail(struct _cap_launch_ctx_s *ctx, int err)
+{
+    while (syscall(SYS_write, ctx->report, &err, sizeof(err)) < 0
+	   && errno == EINTR);
+    syscall(SYS_exit, 127);
+    return 127;
+}
+
+static int _cap_launch_child(void *arg)
+{
+    struct _cap_launch_ctx_s *ctx = arg;
+    const struct cap_launch_s *attr = ctx->attr;
+    unsigned setpcap = CAP_TO_MASK(CAP_SETPCAP);
+    uint64_t bits;
+    int sig;
+
+    /* handlers of the caller must not run in this shared memory */
+    for (sig = 1; sig < NSIG; sig++) {
+	struct sigaction sa;
+
+	if (sigaction(sig, NULL, &sa) == 0 && sa.sa_handler != SIG_IGN
+	    && sa.sa_handler != SIG_DFL) {
+	    sa.sa_handler = SIG_DFL;
+	    sa.sa_flags = 0;
+	    sigaction(sig, &sa, NULL);
+	}
+    }
+
+    if (syscall(SYS_capget, &ctx->head, ctx->data) != 0) {
+	return _cap_launch_fail(ctx, errno);
+    }
+
+    if ((attr->change_iab && attr->bound_drop) || attr->change_secbits) {
+	if (!(ctx->data[CAP_TO_INDEX(CAP_SETPCAP)].effective & setpcap)) {
+	    ctx->data[CAP_TO_INDEX(CAP_SETPCAP)].effective |= setpcap;
+	    if (syscall(SYS_capset, &ctx->head, ctx->data) != 0) {
+		return _cap_launch_fail(ctx, errno);
+	    }
+	}
+	for (bits = attr->change_iab ? attr->bound_drop : 0; bits;
+	     bits &= bits - 1) {
+	    if (syscall(SYS_prctl, PR_CAPBSET_DROP,
+			pr_arg(__builtin_ctzll(bits)), 0, 0, 0) != 0
+		&& errno != EINVAL) {
+		return _cap_launch_fail(ctx, errno);
+	    }
+	}
+	if (attr->change_secbits
+	    && syscall(SYS_prctl, PR_SET_SECUREBITS, pr_arg(attr->secbits),
+		       0, 0, 0) != 0) {
+	    return _cap_launch_fail(ctx, errno);
+	}
+    }
+
+    if (attr->change_uids && attr->change_iab && !attr->change_secbits
+	&& syscall(SYS_prctl, PR_SET_KEEPCAPS, 1, 0, 0, 0) != 0) {
+	return _cap_launch_fail(ctx, errno);
+    }
+    if (attr->change_gids) {
+	if (syscall(_CAP_SYS_SETGROUPS, attr->ngroups, attr->groups) != 0
+	    || syscall(_CAP_SYS_SETRESGID, attr->gid, attr->gid,
+		       attr->gid) != 0) {
+	    return _cap_launch_fail(ctx, errno);
+	}
+    }
+    if (attr->change_uids
+	&& syscall(_CAP_SYS_SETRESUID, attr->uid, attr->uid,
+		   attr->uid) != 0) {
+	return _cap_launch_fail(ctx, errno);
+    }
+
+    if (attr->change_iab) {
+	unsigned i;
+
+	/* a uid change may have cleared the effective set */
+	if (syscall(SYS_capget, &ctx->head, ctx->data) != 0) {
+	    return _cap_launch_fail(ctx, errno);
+	}
+	for (i = 0; i < _LIBCAP_CAPABILITY_U32S; i++) {
+	    ctx->data[i].inheritable = (__u32) (attr->inheritable >> (32 * i));
+	}
+	if (syscall(SYS_capset, &ctx->head, ctx->data) != 0) {
+	    return _cap_launch_fail(ctx, errno);
+	}
+	if (syscall(SYS_prctl, PR_CAP_AMBIENT, PR_CAP_AMBIENT_CLEAR_ALL,
+		    0, 0, 0) != 0 && attr->ambient) {
+	    return _cap_launch_fail(ctx, errno);
+	}
+	for (bits = attr->ambient; bits; bits &= bits - 1) {
+	    if (syscall(SYS_prctl, PR_CAP_AMBIENT, PR_CAP_AMBIENT_RAISE,
+			pr_arg(__builtin_ctzll(bits)), 0, 0) != 0) {
+		return _cap_launch_fail(ctx, errno);
+	    }
+	}
+    }
+
+    sigprocmask(SIG_SETMASK, &ctx->mask, NULL);
+    syscall(SYS_execve, attr->arg0, attr->argv,
+	    attr->envp ? attr->envp : (const char * const *) environ);
+    return _cap_launch_fail(ctx, errno);
+}
+
+/*
+ * Launch the program described by attr, returning its pid, or -1 with
+ * errno describing why the program could not be started.
+ */
+pid_t cap_launch(cap_launch_t attr)
+{
+    struct _cap_launch_ctx_s ctx;
+    sigset_t all;
+    int fds[2], err = 0, saved_errno = errno;
+    ssize_t n;
+    char *stack;
+    pid_t pid;
+
+    if (!good_cap_launch(attr)) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    stack = malloc(_CAP_LAUNCH_STACK);
+    if (stack == NULL) {
+	return -1;
+    }
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+	free(stack);
+	return -1;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.attr = attr;
+    ctx.report = fds[1];
+    ctx.head.version = _libcap_abi()->version;
+    ctx.head.pid = 0;
+
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &ctx.mask);
+    pid = clone(_cap_launch_child, stack + _CAP_LAUNCH_STACK,
+		CLONE_VM | CLONE_VFORK | SIGCHLD, &ctx);
+    if (pid < 0) {
+	err = errno;
+    }
+    sigprocmask(SIG_SETMASK, &ctx.mask, NULL);
+    free(stack);
+
+    close(fds[1]);
+    if (pid > 0) {
+	while ((n = read(fds[0], &err, sizeof(err))) < 0 && errno == EINTR);
+	if (n == sizeof(err)) {
+	    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+	    pid = -1;
+	} else {
+	    err = 0;
+	}
+    }
+    close(fds[0]);
+
+    errno = err ? err : saved_errno;
+    return err ? -1 : pid;
+}
@@ -15,13 +15,9 @@
 #include <ctype.h>
 #include <limits.h>
 
-#ifdef INCLUDE_GPERF_OUTPUT
-/* we need to include it after #define _GNU_SOURCE is set */
-#include INCLUDE_GPERF_OUTPUT
-#endif
-
 /* Maximum output text length (16 per cap) */
 #define CAP_TEXT_SIZE    (16*__CAP_MAXBITS)
+#define CAP_TEXT_BUFFER_ZONE 100
 
 /*
  * Parse a textual representation of capabilities, returning an internal
@@ -81,49 +77,38 @@ static int lookupname(char const **strp)
 	return n;
     } else {
 	int c;
-	unsigned len;
+	unsigned len, n;
+	__u32 h = __CAP_NAME_HASH_SEED;
+	char const *s;
 
 	for (len=0; (c = str.constp[len]); ++len) {
 	    if (!(isalpha(c) || (c == '_'))) {
 		break;
 	    }
+	    h = __CAP_NAME_HASH_STEP(h, c);
 	}
 
-#ifdef GPERF_DOWNCASE
-	const struct __cap_token_s *token_info;
-
-	token_info = __cap_lookup_name(str.constp, len);
-	if (token_info != NULL) {
-	    *strp = str.constp + len;
-	    return token_info->index;
+	/*
+	 * The generated table is collision free for the known names,
+	 * so a single slot decides; namcmp() rejects any other token
+	 * that happens to hash there.
+	 */
+	n = _cap_name_hash[h >> (32 - __CAP_NAME_HASH_BITS)];
+	if (n-- && (s = namcmp(str.constp, _cap_names[n]))) {
+	    *strp = s;
+	    return n;
 	}
-#else /* ie., ndef GPERF_DOWNCASE */
-	char const *s;
-	unsigned n;
-
-	for (n = __CAP_BITS; n--; )
-	    if (_cap_names[n] && (s = namcmp(str.constp, _cap_names[n]))) {
-		*strp = s;
-		return n;
-	    }
-#endif /* def GPERF_DOWNCASE */
 
 	return -1;   	/* No definition available */
     }
 }
 
-cap_t cap_from_text(const char *str)
+static cap_t _cap_text_parse(const char *str)
 {
     cap_t res;
     int n;
     unsigned cap_blks;
 
-    if (str == NULL) {
-	_cap_debug("bad argument");
-	errno = EINVAL;
-	return NULL;
-    }
-
     if (!(res = cap_init()))
 	return NULL;
 
@@ -269,6 +254,324 @@ bad:
     return res;
 }
 
+/*
+ * Optional memoization of cap_from_text(). Programs that parse the
+ * same few strings over and over can enable this with
+ * cap_text_cache_enable(). Parsed sets are then kept, keyed by their
+ * text, in a bounded LRU that is split into shards so that threads
+ * parsing different strings rarely share a lock. Each shard indexes
+ * its entries in a hash table; the list only records recency.
+ */
+
+#define CAP_TEXT_CACHE_SHARDS  16
+
+struct _cap_text_entry_s {
+    struct _cap_text_entry_s *prev, *next;
+    struct _cap_text_entry_s *chain;         /* next in the same bucket */
+    __u32 hash;
+    struct _cap_struct set;
+    char text[];
+};
+
+static struct _cap_text_shard_s {
+    __u8 mu;
+    unsigned count, limit;
+    struct _cap_text_entry_s *head, *tail;   /* most, least recently used */
+    struct _cap_text_entry_s **buckets;
+    unsigned mask;                           /* buckets - 1 */
+    unsigned long hits, misses, evictions;
+} _cap_text_shards[CAP_TEXT_CACHE_SHARDS];
+
+static int _cap_text_cache_on;
+
+static __u32 _cap_text_hash(const char *str, size_t *len_p)
+{
+    const char *s;
+    __u32 h = 0x811c9dc5U;
+
+    for (s = str; *s; s++) {
+	h = (h ^ (unsigned char) *s) * 0x01000193U;
+    }
+    *len_p = s - str;
+
+    return h;
+}
+
+/*
+ * The low bits of the hash pick the shard, so the buckets within a
+ * shard are indexed by the bits above them.
+ */
+static struct _cap_text_entry_s **_cap_text_bucket(struct _cap_text_shard_s *shard,
+						   __u32 hash)
+{
+    return &shard->buckets[(hash / CAP_TEXT_CACHE_SHARDS) & shard->mask];
+}
+
+static void _cap_text_bucket_add(struct _cap_text_shard_s *shard,
+				 struct _cap_text_entry_s *entry)
+{
+    struct _cap_text_entry_s **b = _cap_text_bucket(shard, entry->hash);
+
+    entry->chain = *b;
+    *b = entry;
+}
+
+static void _cap_text_bucket_del(struct _cap_text_shard_s *shard,
+				 struct _cap_text_entry_s *entry)
+{
+    struct _cap_text_entry_s **b = _cap_text_bucket(shard, entry->hash);
+
+    while (*b != entry) {
+	b = &(*b)->chain;
+    }
+    *b = entry->chain;
+}
+
+static void _cap_text_unlink(struct _cap_text_shard_s *shard,
+			     struct _cap_text_entry_s *entry)
+{
+    if (entry->prev) {
+	entry->prev->next = entry->next;
+    } else {
+	shard->head = entry->next;
+    }
+    if (entry->next) {
+	entry->next->prev = entry->prev;
+    } else {
+	shard->tail = entry->prev;
+    }
+    shard->count--;
+}
+
+static void _cap_text_push(struct _cap_text_shard_s *shard,
+			   struct _cap_text_entry_s *entry)
+{
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head) {
+	shard->head->prev = entry;
+    } else {
+	shard->tail = entry;
+    }
+    shard->head = entry;
+    shard->count++;
+}
+
+/*
+ * Unhook least recently used entries until the shard is within its
+ * limit. Called with the shard locked; the returned chain is freed
+ * by the caller once it has dropped the lock.
+ */
+static struct _cap_text_entry_s *_cap_text_trim(struct _cap_text_shard_s *shard)
+{
+    struct _cap_text_entry_s *chain = NULL, *entry;
+
+    while (shard->count > shard->limit) {
+	entry = shard->tail;
+	_cap_text_unlink(shard, entry);
+	_cap_text_bucket_del(shard, entry);
+	entry->next = chain;
+	chain = entry;
+	shard->evictions++;
+    }
+
+    return chain;
+}
+
+static void _cap_text_free_chain(struct _cap_text_entry_s *chain)
+{
+    struct _cap_text_entry_s *entry;
+
+    while ((entry = chain) != NULL) {
+	chain = entry->next;
+	free(entry);
+    }
+}
+
+static struct _cap_text_entry_s *_cap_text_find(struct _cap_text_shard_s *shard,
+						__u32 hash, const char *str)
+{
+    struct _cap_text_entry_s *entry;
+
+    if (shard->buckets == NULL) {
+	return NULL;
+    }
+    for (entry = *_cap_text_bucket(shard, hash); entry; entry = entry->chain) {
+	if (entry->hash == hash && !strcmp(entry->text, str)) {
+	    break;
+	}
+    }
+
+    return entry;
+}
+
+static cap_t _cap_text_cached(const char *str)
+{
+    struct _cap_text_shard_s *shard;
+    struct _cap_text_entry_s *entry, *chain;
+    struct _cap_struct set;
+    cap_t res;
+    size_t len;
+    __u32 hash;
+
+    hash = _cap_text_hash(str, &len);
+    shard = &_cap_text_shards[hash % CAP_TEXT_CACHE_SHARDS];
+
+    _cap_mu_lock(&shard->mu);
+    entry = _cap_text_find(shard, hash, str);
+    if (entry != NULL) {
+	shard->hits++;
+	if (entry != shard->head) {
+	    _cap_text_unlink(shard, entry);
+	    _cap_text_push(shard, entry);
+	}
+	set = entry->set;
+	_cap_mu_unlock(&shard->mu);
+
+	if ((res = cap_init()) != NULL) {
+	    memcpy(res, &set, sizeof(set));
+	}
+	return res;
+    }
+    shard->misses++;
+    _cap_mu_unlock(&shard->mu);
+
+    res = _cap_text_parse(str);
+    if (res == NULL) {
+	return NULL;                   /* failures are not remembered */
+    }
+
+    entry = malloc(sizeof(*entry) + len + 1);
+    if (entry == NULL) {
+	return res;                    /* just not cached */
+    }
+    entry->hash = hash;
+    entry->set = *res;
+    memcpy(entry->text, str, len + 1);
+
+    _cap_mu_lock(&shard->mu);
+    if (shard->limit == 0 || _cap_text_find(shard, hash, str) != NULL) {
+	/* disabled, or another thread beat us to it */
+	entry->next = NULL;
+	chain = entry;
+    } else {
+	_cap_text_push(shard, entry);
+	_cap_text_bucket_add(shard, entry);
+	chain = _cap_text_trim(shard);
+    }
+    _cap_mu_unlock(&shard->mu);
+
+    _cap_text_free_chain(chain);
+
+    return res;
+}
+
+cap_t cap_from_text(const char *str)
+{
+    if (str == NULL) {
+	_cap_debug("bad argument");
+	errno = EINVAL;
+	return NULL;
+    }
+
+    if (__atomic_load_n(&_cap_text_cache_on, __ATOMIC_RELAXED)) {
+	return _cap_text_cached(str);
+    }
+
+    return _cap_text_parse(str);
+}
+
+/*
+ * Bound the cap_from_text() cache to (about) entries parsed sets.
+ * Zero disables the cache and discards its content. Shrinking the
+ * cache evicts the least recently used entries immediately.
+ */
+
+int cap_text_cache_enable(size_t entries)
+{
+    struct _cap_text_entry_s **tables[CAP_TEXT_CACHE_SHARDS];
+    unsigned i, limit, size = 0;
+
+    if (entries > UINT_MAX - CAP_TEXT_CACHE_SHARDS) {
+	errno = EINVAL;
+	return -1;
+    }
+    limit = (entries + CAP_TEXT_CACHE_SHARDS - 1) / CAP_TEXT_CACHE_SHARDS;
+
+    /* one bucket per entry, rounded up to a power of two */
+    memset(tables, 0, sizeof(tables));
+    if (limit != 0) {
+	for (size = 1; size < limit; size <<= 1);
+	for (i = 0; i < CAP_TEXT_CACHE_SHARDS; i++) {
+	    tables[i] = calloc(size, sizeof(*tables[i]));
+	    if (tables[i] == NULL) {
+		while (i-- > 0) {
+		    free(tables[i]);
+		}
+		errno = ENOMEM;
+		return -1;
+	    }
+	}
+    }
+
+    if (entries == 0) {
+	__atomic_store_n(&_cap_text_cache_on, 0, __ATOMIC_RELAXED);
+    }
+
+    for (i = 0; i < CAP_TEXT_CACHE_SHARDS; i++) {
+	struct _cap_text_shard_s *shard = &_cap_text_shards[i];
+	struct _cap_text_entry_s *chain, *entry, **old;
+
+	_cap_mu_lock(&shard->mu);
+	shard->limit = limit;
+	chain = _cap_text_trim(shard);
+	old = shard->buckets;
+	shard->buckets = tables[i];
+	shard->mask = size - 1;
+	for (entry = shard->head; entry; entry = entry->next) {
+	    _cap_text_bucket_add(shard, entry);
+	}
+	_cap_mu_unlock(&shard->mu);
+
+	free(old);
+	_cap_text_free_chain(chain);
+    }
+
+    if (entries != 0) {
+	__atomic_store_n(&_cap_text_cache_on, 1, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+/*
+ * Report the cap_from_text() cache counters.
+ */
+
+int cap_text_cache_stats(cap_text_cache_stats_t *stats)
+{
+    unsigned i;
+
+    if (stats == NULL) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < CAP_TEXT_CACHE_SHARDS; i++) {
+	struct _cap_text_shard_s *shard = &_cap_text_shards[i];
+
+	_cap_mu_lock(&shard->mu);
+	stats->hits += shard->hits;
+	stats->misses += shard->misses;
+	stats->evictions += shard->evictions;
+	stats->entries += shard->count;
+	_cap_mu_unlock(&shard->mu);
+    }
+
+    return 0;
+}
+
 /*
  * lookup a capability name and return its numerical value
  */
@@ -282,65 +585,133 @@ int cap_from_name(const char *name, cap_value_t *value_p)
     return -(n < 0);
 }
 
+/*
+ * Return the name of a capability as a borrowed pointer to static
+ * storage. Capabilities without a name yield NULL.
+ */
+const char *cap_name_static(cap_value_t cap)
+{
+    if ((cap < 0) || (cap >= __CAP_BITS)) {
+	return NULL;
+    }
+    return _cap_names[cap];
+}
+
 /*
  * Convert a single capability index number into a string representation
  */
 char *cap_to_name(cap_value_t cap)
 {
-    if ((cap < 0) || (cap >= __CAP_BITS)) {
+    const char *name = cap_name_static(cap);
+
+    if (name == NULL) {
 #if UINT_MAX != 4294967295U
 # error Recompile with correctly sized numeric array
 #endif
-	char *tmp, *result;
-
-	asprintf(&tmp, "%u", cap);
-	result = _libcap_strdup(tmp);
-	free(tmp);
+	char tmp[sizeof("4294967295")];
 
-	return result;
+	snprintf(tmp, sizeof(tmp), "%u", cap);
+	return _libcap_strdup(tmp);
     } else {
-	return _libcap_strdup(_cap_names[cap]);
+	return _libcap_strdup(name);
     }
 }
 
 /*
- * Convert an internal representation to a textual one. The textual
- * representation is stored in static memory. It will be overwritten
- * on the next occasion that this function is called.
+ * Convert an internal representation to a textual one.
  */
 
-static int getstateflags(cap_t caps, int capno)
+/*
+ * Return the bits of block blk that lie in the capability range
+ * [from, to).
+ */
+static __u32 _bit_range(unsigned blk, unsigned from, unsigned to)
 {
-    int f = 0;
+    unsigned lo = 32 * blk, hi = lo + 32;
+    __u32 mask = ~0U;
 
-    if (isset_cap(caps, capno, CAP_EFFECTIVE)) {
-	f |= LIBCAP_EFF;
+    if (from >= hi || to <= lo || from >= to) {
+	return 0;
     }
-    if (isset_cap(caps, capno, CAP_PERMITTED)) {
-	f |= LIBCAP_PER;
+    if (from > lo) {
+	mask &= ~0U << (from - lo);
     }
-    if (isset_cap(caps, capno, CAP_INHERITABLE)) {
-	f |= LIBCAP_INH;
+    if (to < hi) {
+	mask &= ~0U >> (hi - to);
     }
+    return mask;
+}
 
-    return f;
+/*
+ * The text is accumulated in a caller supplied buffer. Output that
+ * does not fit is counted, but discarded, so the caller can learn
+ * how much space is needed.
+ */
+struct _cap_text_s {
+    char *buf;
+    size_t len;
+    size_t pos;
+};
+
+static void _text_put(struct _cap_text_s *out, const char *s, size_t n)
+{
+    if (out->pos < out->len) {
+	size_t room = out->len - out->pos;
+	memcpy(out->buf + out->pos, s, n < room ? n : room);
+    }
+    out->pos += n;
 }
 
-#define CAP_TEXT_BUFFER_ZONE 100
+static void _text_put_name(struct _cap_text_s *out, cap_value_t cap)
+{
+    const char *name = cap_name_static(cap);
+    char tmp[sizeof("4294967295")];
 
-char *cap_to_text(cap_t caps, ssize_t *length_p)
+    if (name == NULL) {
+	snprintf(tmp, sizeof(tmp), "%u", cap);
+	name = tmp;
+    }
+    _text_put(out, name, strlen(name));
+}
+
+static void _text_put_flags(struct _cap_text_s *out, char op, int flags)
 {
-    char buf[CAP_TEXT_SIZE+CAP_TEXT_BUFFER_ZONE];
-    char *p;
+    char tmp[4];
+    size_t n = 0;
+
+    tmp[n++] = op;
+    if (flags & LIBCAP_EFF) {
+	tmp[n++] = 'e';
+    }
+    if (flags & LIBCAP_INH) {
+	tmp[n++] = 'i';
+    }
+    if (flags & LIBCAP_PER) {
+	tmp[n++] = 'p';
+    }
+    _text_put(out, tmp, n);
+}
+
+/*
+ * Write the textual form of caps into buf, which holds len bytes.
+ * Like snprintf(), the return value is the length of the complete
+ * text (excluding the terminating NUL). If that is not less than len,
+ * the text has been truncated and errno is set to ERANGE. No memory
+ * is allocated.
+ */
+ssize_t cap_to_text_r(cap_t caps, char *buf, size_t len)
+{
+    struct _cap_text_s out;
+    __u32 combo[8][__CAP_BLKS];
     int histo[8];
     int m, t;
-    unsigned n;
+    unsigned n, skip;
     unsigned cap_maxbits, cap_blks;
 
     /* Check arguments */
-    if (!good_cap_t(caps)) {
+    if (!good_cap_t(caps) || (buf == NULL && len != 0)) {
 	errno = EINVAL;
-	return NULL;
+	return -1;
     }
 
     switch (caps->head.version) {
@@ -355,7 +726,7 @@ char *cap_to_text(cap_t caps, ssize_t *length_p)
 	break;
     default:
 	errno = EINVAL;
-	return NULL;
+	return -1;
     }
 
     cap_maxbits = 32 * cap_blks;
@@ -364,11 +735,36 @@ char *cap_to_text(cap_t caps, ssize_t *length_p)
     _cap_debugcap("i = ", *caps, CAP_INHERITABLE);
     _cap_debugcap("p = ", *caps, CAP_PERMITTED);
 
-    memset(histo, 0, sizeof(histo));
+    /*
+     * Partition the bits of each block into the eight combinations
+     * of E, I and P. combo[t] holds the bits whose state is exactly t.
+     */
+    for (n = 0; n < cap_blks; n++) {
+	__u32 e = caps->u[n].flat[CAP_EFFECTIVE];
+	__u32 i = caps->u[n].flat[CAP_INHERITABLE];
+	__u32 p = caps->u[n].flat[CAP_PERMITTED];
+
+	for (t = 0; t < 8; t++) {
+	    combo[t][n] = ((t & LIBCAP_EFF) ? e : ~e)
+		& ((t & LIBCAP_INH) ? i : ~i)
+		& ((t & LIBCAP_PER) ? p : ~p);
+	}
+    }
 
-    /* default prevailing state to the upper - unnamed bits */
-    for (n = cap_maxbits-1; n > __CAP_BITS; n--)
-	histo[getstateflags(caps, n)]++;
+    /*
+     * default prevailing state to the upper - unnamed bits. For
+     * historical compatibility, the bit numbered skip is not counted
+     * towards either the upper or lower bits.
+     */
+    skip = (cap_maxbits - 1 < __CAP_BITS) ? cap_maxbits - 1 : __CAP_BITS;
+    for (t = 0; t < 8; t++) {
+	histo[t] = 0;
+	for (n = 0; n < cap_blks; n++) {
+	    histo[t] += __builtin_popcount(combo[t][n]
+					   & _bit_range(n, skip + 1,
+							cap_maxbits));
+	}
+    }
 
     /* find which combination of capability sets shares the most bits
        we bias to preferring non-set (m=0) with the >= 0 test. Failing
@@ -381,57 +777,71 @@ char *cap_to_text(cap_t caps, ssize_t *length_p)
     /* capture remaining bits - selecting m from only the unnamed bits,
        we maximize the likelihood that we won't see numeric capability
        values in the text output. */
-    while (n--)
-	histo[getstateflags(caps, n)]++;
+    for (t = 0; t < 8; t++) {
+	for (n = 0; n < cap_blks; n++) {
+	    histo[t] += __builtin_popcount(combo[t][n]
+					   & _bit_range(n, 0, skip));
+	}
+    }
+
+    out.buf = buf;
+    out.len = len;
+    out.pos = 0;
 
     /* blank is not a valid capability set */
-    p = sprintf(buf, "=%s%s%s",
-		(m & LIBCAP_EFF) ? "e" : "",
-		(m & LIBCAP_INH) ? "i" : "",
-		(m & LIBCAP_PER) ? "p" : "" ) + buf;
+    _text_put_flags(&out, '=', m);
 
     for (t = 8; t--; ) {
+	const char *sep = " ";
+
 	if (t == m || !histo[t]) {
 	    continue;
 	}
-	*p++ = ' ';
-	for (n = 0; n < cap_maxbits; n++) {
-	    if (getstateflags(caps, n) == t) {
-	        char *this_cap_name;
-
-	        this_cap_name = cap_to_name(n);
-	        if ((strlen(this_cap_name) + (p - buf)) > CAP_TEXT_SIZE) {
-		    cap_free(this_cap_name);
-		    errno = ERANGE;
-		    return NULL;
-	        }
-	        p += sprintf(p, "%s,", this_cap_name);
-	        cap_free(this_cap_name);
+	for (n = 0; n < cap_blks; n++) {
+	    __u32 bits;
+
+	    for (bits = combo[t][n]; bits; bits &= bits - 1) {
+		_text_put(&out, sep, 1);
+		_text_put_name(&out, 32 * n + __builtin_ctz(bits));
+		sep = ",";
 	    }
 	}
-	p--;
-	n = t & ~m;
-	if (n) {
-	    p += sprintf(p, "+%s%s%s",
-			 (n & LIBCAP_EFF) ? "e" : "",
-			 (n & LIBCAP_INH) ? "i" : "",
-			 (n & LIBCAP_PER) ? "p" : "");
+	if (t & ~m) {
+	    _text_put_flags(&out, '+', t & ~m);
 	}
-	n = ~t & m;
-	if (n) {
-	    p += sprintf(p, "-%s%s%s",
-			 (n & LIBCAP_EFF) ? "e" : "",
-			 (n & LIBCAP_INH) ? "i" : "",
-			 (n & LIBCAP_PER) ? "p" : "");
+	if (~t & m) {
+	    _text_put_flags(&out, '-', ~t & m);
 	}
-	if (p - buf > CAP_TEXT_SIZE) {
-	    errno = ERANGE;
-	    return NULL;
+    }
+
+    if (out.pos < len) {
+	buf[out.pos] = '\0';
+	_cap_debug("%s", buf);
+    } else {
+	if (len != 0) {
+	    buf[len-1] = '\0';
 	}
+	errno = ERANGE;
+    }
+
+    return out.pos;
+}
+
+char *cap_to_text(cap_t caps, ssize_t *length_p)
+{
+    char buf[CAP_TEXT_SIZE+CAP_TEXT_BUFFER_ZONE];
+    ssize_t length;
+
+    length = cap_to_text_r(caps, buf, sizeof(buf));
+    if (length < 0) {
+	return NULL;
+    }
+    if (length >= ssizeof(buf)) {
+	errno = ERANGE;
+	return NULL;
     }
-    _cap_debug("%s", buf);
     if (length_p) {
-	*length_p = p - buf;
+	*length_p = length;
     }
 
     return (_libcap_strdup(buf));
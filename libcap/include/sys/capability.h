@@ -63,6 +63,62 @@ typedef enum {
     CAP_SET=1                                    /* The flag is set/enabled */
 } cap_flag_value_t;
 
+/*
+ * Allocation counters for the optional cap_t pool
+ */
+typedef struct {
+    unsigned long slabs;     /* heap allocations made to grow the pool */
+    unsigned long allocs;    /* cap_t values handed out by the pool */
+    unsigned long frees;     /* cap_t values returned to the pool */
+    unsigned long in_use;    /* pooled cap_t values still outstanding */
+    unsigned long local;     /* allocs served from the thread's own list */
+} cap_pool_stats_t;
+
+/*
+ * Caller provided (for example, automatic) storage for a single cap_t,
+ * see cap_init_storage(). Its content is private to libcap.
+ */
+#define CAP_STORAGE_WORDS 16
+typedef struct {
+    uint64_t opaque[CAP_STORAGE_WORDS];
+} cap_storage_t;
+
+/*
+ * Counters for the optional cap_from_text() cache
+ */
+typedef struct {
+    unsigned long hits;      /* cap_from_text() calls served from the cache */
+    unsigned long misses;    /* cap_from_text() calls that had to parse */
+    unsigned long evictions; /* parsed sets dropped to respect the bound */
+    unsigned long entries;   /* parsed sets presently cached */
+} cap_text_cache_stats_t;
+
+/*
+ * All of the capability state of a process, see cap_get_snapshot().
+ * The valid member says which of the other members were filled in.
+ */
+#define CAP_SNAPSHOT_IPE           1  /* inheritable, permitted, effective */
+#define CAP_SNAPSHOT_BOUNDING      2
+#define CAP_SNAPSHOT_AMBIENT       4
+#define CAP_SNAPSHOT_SECUREBITS    8  /* only for the calling thread */
+#define CAP_SNAPSHOT_NO_NEW_PRIVS 16
+typedef struct {
+    uint64_t inheritable;
+    uint64_t permitted;
+    uint64_t effective;
+    uint64_t bounding;
+    uint64_t ambient;
+    unsigned securebits;
+    int no_new_privs;
+    unsigned valid;
+} cap_snapshot_t;
+
+/*
+ * The attributes of a process launched with cap_launch(). Free it
+ * with cap_free().
+ */
+typedef struct cap_launch_s *cap_launch_t;
+
 /*
  * User-space capability manipulation routines
  */
@@ -71,6 +127,10 @@ typedef enum {
 extern cap_t   cap_dup(cap_t);
 extern int     cap_free(void *);
 extern cap_t   cap_init(void);
+extern cap_t   cap_init_storage(cap_storage_t *);
+extern cap_value_t cap_max_bits(void);
+extern int     cap_pool_enable(int);
+extern int     cap_pool_stats(cap_pool_stats_t *);
 
 /* libcap/cap_flag.c */
 extern int     cap_get_flag(cap_t, cap_value_t, cap_flag_t, cap_flag_value_t *);
@@ -78,6 +138,14 @@ extern int     cap_set_flag(cap_t, cap_flag_t, int, const cap_value_t *,
 			    cap_flag_value_t);
 extern int     cap_clear(cap_t);
 extern int     cap_clear_flag(cap_t, cap_flag_t);
+extern int     cap_union(cap_t, cap_t);
+extern int     cap_intersect(cap_t, cap_t);
+extern int     cap_diff(cap_t, cap_t);
+extern int     cap_xor(cap_t, cap_t);
+extern int     cap_merge_flag(cap_t, cap_t, cap_flag_t);
+extern int     cap_get_mask(cap_t, cap_flag_t, uint64_t *);
+extern int     cap_set_mask(cap_t, cap_flag_t, uint64_t);
+extern cap_value_t cap_next_raised(cap_t, cap_flag_t, cap_value_t);
 
 /* libcap/cap_file.c */
 extern cap_t   cap_get_fd(int);
@@ -94,23 +162,42 @@ extern int     cap_set_proc(cap_t);
 
 extern int     cap_get_bound(cap_value_t);
 extern int     cap_drop_bound(cap_value_t);
+extern int     cap_drop_bound_mask(uint64_t);
 #define CAP_IS_SUPPORTED(cap)  (cap_get_bound(cap) >= 0)
 
 extern int     cap_get_ambient(cap_value_t);
 extern int     cap_set_ambient(cap_value_t, cap_flag_value_t);
 extern int     cap_reset_ambient(void);
+extern uint64_t cap_set_ambient_mask(uint64_t, uint64_t);
 #define CAP_AMBIENT_SUPPORTED() (cap_get_ambient(CAP_CHOWN) >= 0)
 
+extern int     cap_get_snapshot(pid_t, cap_snapshot_t *);
+
+extern cap_launch_t cap_new_launcher(const char *, const char * const *,
+				     const char * const *);
+extern int     cap_launcher_setuid(cap_launch_t, uid_t);
+extern int     cap_launcher_setgroups(cap_launch_t, gid_t, int,
+				      const gid_t *);
+extern int     cap_launcher_set_iab(cap_launch_t, uint64_t, uint64_t,
+				    uint64_t);
+extern int     cap_launcher_set_secbits(cap_launch_t, unsigned);
+extern pid_t   cap_launch(cap_launch_t);
+
 /* libcap/cap_extint.c */
 extern ssize_t cap_size(cap_t);
 extern ssize_t cap_copy_ext(void *, cap_t, ssize_t);
 extern cap_t   cap_copy_int(const void *);
+extern int     cap_copy_int_into(cap_t, const void *);
 
 /* libcap/cap_text.c */
 extern cap_t   cap_from_text(const char *);
 extern char *  cap_to_text(cap_t, ssize_t *);
+extern ssize_t cap_to_text_r(cap_t, char *, size_t);
 extern int     cap_from_name(const char *, cap_value_t *);
 extern char *  cap_to_name(cap_value_t);
+extern const char *cap_name_static(cap_value_t);
+extern int     cap_text_cache_enable(size_t);
+extern int     cap_text_cache_stats(cap_text_cache_stats_t *);
 
 #define CAP_DIFFERS(result, flag)  (((result) & (1 << (flag))) != 0)
 extern int     cap_compare(cap_t, cap_t);
@@ -39,6 +39,8 @@
 #define _SYS_PSX_SYSCALL_H
 
 #include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
 
 /*
  * This function is actually provided by the linker trick:
@@ -89,6 +91,100 @@ long int psx_syscall6(long int syscall_nr,
 		      long int arg1, long int arg2, long int arg3,
 		      long int arg4, long int arg5, long int arg6);
 
+/*
+ * psx_step_t describes one system call of a psx_syscall_batch(). The
+ * caller fills in syscall_nr and arg[], unused arguments should be
+ * zero. On return, ret and err hold the result of the step on the
+ * calling thread (err is 0 for success, the errno value otherwise).
+ */
+typedef struct psx_step_s {
+    long int syscall_nr;
+    long int arg[6];
+    long int ret;
+    int err;
+} psx_step_t;
+
+/*
+ * psx_syscall_batch performs the n steps, in order, on the calling
+ * thread and then, in a single signal round, on all the other psx
+ * registered threads. The batch stops at the first step that fails on
+ * the calling thread; the steps that did succeed are still applied to
+ * the other threads so they all end up in the same state, and the
+ * remaining steps are not attempted. Return status of 0 means every
+ * step succeeded. Otherwise, -1 is returned, errno is set to the
+ * failing step's err and that step is the first with a non-zero err.
+ * Other threads likewise stop their own sequence at the first step
+ * that fails for them.
+ */
+int psx_syscall_batch(psx_step_t *steps, int n);
+
+/*
+ * psx_set_combining enables (non-zero) or disables (zero) flat
+ * combining of concurrent psx_syscall() and psx_syscall_batch()
+ * callers. It returns the previous setting. When enabled, callers
+ * that have to wait for another caller's broadcast to finish publish
+ * their requests instead, and the next thread to get to run
+ * broadcasts all of the pending requests at once. Each caller still
+ * gets its own return value and errno. Only threads started by
+ * psx_pthread_create() (or a wrapped pthread_create()), and those
+ * that called psx_register(pthread_self()), take part; other callers
+ * behave as if combining were disabled.
+ */
+int psx_set_combining(int enabled);
+
+/*
+ * psx_stuck_t describes a thread that did not respond to a
+ * psx_syscall_timed() broadcast in time. tid is 0 for threads that
+ * were registered by another thread: psx cannot know their tid, nor
+ * whether they responded, so they are always listed.
+ * state is the thread's scheduling state, as found in the third
+ * field of /proc/self/task/<tid>/stat (for example, 'R', 'S', 't' or
+ * 'T'), or '?' if unknown. blocked is 1 if the thread's signal mask
+ * blocks the psx interrupt, 0 if not and -1 if unknown.
+ */
+typedef struct psx_stuck_s {
+    pthread_t thread;
+    pid_t tid;
+    char state;
+    int blocked;
+} psx_stuck_t;
+
+/*
+ * psx_syscall_timed works like psx_syscall_batch(), but it only waits
+ * for the other threads until the CLOCK_MONOTONIC time, deadline. If
+ * some have not responded by then, the broadcast is abandoned and -1
+ * is returned with errno set to ETIMEDOUT. The threads that did not
+ * respond will not perform the steps even if they get to run later,
+ * so the program's threads can then be in differing states. On entry,
+ * *nstuck is the number of entries available in stuck. On return, it
+ * is the number of threads that did not respond, and up to that many
+ * entries of stuck describe them.
+ */
+int psx_syscall_timed(const struct timespec *deadline,
+		      psx_step_t *steps, int n,
+		      psx_stuck_t *stuck, int *nstuck);
+
+/*
+ * psx_stats_t holds counters for the broadcasts made so far:
+ * broadcasts counts them, retries counts signals that had to be sent
+ * again because they could not be queued, and timeouts counts the
+ * broadcasts psx_syscall_timed() abandoned. slowest_ns is the longest
+ * time a completed broadcast waited for its responders, and
+ * slowest_tid is the tid of the last thread to respond to it.
+ */
+typedef struct psx_stats_s {
+    unsigned long broadcasts;
+    unsigned long retries;
+    unsigned long timeouts;
+    unsigned long slowest_ns;
+    pid_t slowest_tid;
+} psx_stats_t;
+
+/*
+ * psx_get_stats fills in *stats with the current counters.
+ */
+void psx_get_stats(psx_stats_t *stats);
+
 /*
  * psx_register registers a pthread with the psx abstraction of system
  * calls.
@@ -125,4 +221,11 @@ void share_psx_syscall(long int (*syscall_fn)(long int,
 					       long int, long int, long int,
 					       long int, long int, long int));
 
+/*
+ * share_psx_syscall_batch() is the psx_syscall_batch() counterpart
+ * of share_psx_syscall(). It too is weakly defined as a no-op in
+ * libpsx and libcap provides an implementation of it.
+ */
+void share_psx_syscall_batch(int (*batch_fn)(psx_step_t *steps, int n));
+
 #endif /* _SYS_PSX_SYSCALL_H */
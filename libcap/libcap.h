@@ -9,6 +9,8 @@
 #define LIBCAP_H
 
 #include <errno.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -121,12 +123,63 @@ struct _cap_struct {
     uid_t rootid;
 };
 
+/*
+ * Every cap_t is preceded in memory by two words: a record of where
+ * its storage came from (one of the _CAP_ALLOC_* values), and the
+ * CAP_T_MAGIC marker that good_cap_t() looks for.
+ */
+#define _CAP_ALLOC_HEAP   0    /* calloc()'d, free()'d by cap_free() */
+#define _CAP_ALLOC_POOL   1    /* carved from a cap_pool_enable() slab */
+#define _CAP_ALLOC_STORAGE 2   /* caller's cap_storage_t, only scrubbed */
+
+struct _cap_alloc_s {
+    __u32 origin;
+    __u32 magic;
+    union {
+	struct _cap_struct set;
+	struct _cap_alloc_s *next;   /* link while idle in a pool */
+    } u;
+};
+
+#define cap_t_alloc(c) \
+    ((struct _cap_alloc_s *) (((char *) (c)) \
+			      - offsetof(struct _cap_alloc_s, u.set)))
+
 /* the maximum bits supportable */
 #define __CAP_MAXBITS (__CAP_BLKS * 32)
 
 /* string magic for cap_free */
 #define CAP_S_MAGIC 0xCA95D0
 
+/* launcher magic for cap_free */
+#define CAP_LAUNCH_MAGIC 0xCA91D0
+
+/*
+ * The attributes of a cap_launch(). Like a cap_t, it is preceded in
+ * memory by its magic.
+ */
+struct cap_launch_s {
+    const char *arg0;
+    const char * const *argv;
+    const char * const *envp;
+    int change_uids;
+    uid_t uid;
+    int change_gids;
+    gid_t gid;
+    int ngroups;
+    gid_t *groups;
+    int change_iab;
+    uint64_t inheritable, ambient, bound_drop;
+    int change_secbits;
+    unsigned secbits;
+};
+
+struct _cap_launch_alloc_s {
+    __u32 reserved;
+    __u32 magic;
+    struct cap_launch_s launch;
+};
+
 /*
  * kernel API cap set abstraction
  */
@@ -142,6 +195,7 @@ struct _cap_struct {
 #define __libcap_check_magic(c,magic) ((c) && *(-1+(__u32 *)(c)) == (magic))
 #define good_cap_t(c)        __libcap_check_magic(c, CAP_T_MAGIC)
 #define good_cap_string(c)   __libcap_check_magic(c, CAP_S_MAGIC)
+#define good_cap_launch(c)   __libcap_check_magic(c, CAP_LAUNCH_MAGIC)
 
 /*
  * These match CAP_DIFFERS() expectations
@@ -180,6 +234,26 @@ struct _cap_struct {
 
 extern char *_libcap_strdup(const char *text);
 
+/*
+ * A minimal spin lock for the short critical sections inside the
+ * library. Using it avoids a dependency on -lpthread.
+ */
+#define _cap_mu_lock(x) \
+    while (__atomic_test_and_set((void *) (x), __ATOMIC_SEQ_CST)) sched_yield()
+#define _cap_mu_unlock(x) \
+    __atomic_clear((void *) (x), __ATOMIC_SEQ_CST)
+
+/*
+ * The kernel's capability ABI, probed once per process.
+ */
+struct _cap_abi_s {
+    __u32 version;          /* preferred _LINUX_CAPABILITY_VERSION_* */
+    unsigned u32s;          /* number of __u32 words per capability set */
+    cap_value_t max_bits;   /* number of capabilities the kernel supports */
+};
+
+extern const struct _cap_abi_s *_libcap_abi(void);
+
 /*
  * These are semi-public prototypes, they will only be defined in
  * <sys/capability.h> if _POSIX_SOURCE is not #define'd, so we
@@ -10,13 +10,21 @@
  * mechanism to synchronize thread state over the whole process.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <linux/futex.h>
 #include <sys/psx_syscall.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 /*
@@ -35,13 +43,51 @@ void share_psx_syscall(long int (*syscall_fn)(long int,
 }
 
 /*
- * type to keep track of registered threads.
+ * share_psx_syscall_batch() advertizes psx_syscall_batch() in the
+ * same way.
+ */
+__attribute__((weak))
+void share_psx_syscall_batch(int (*batch_fn)(psx_step_t *steps, int n))
+{
+}
+
+/*
+ * type to keep track of registered threads. Slots live in a single
+ * array owned by psx_tracker.registry, and unused slots are chained
+ * together through their next field into a free list. tid is only
+ * known for threads that registered themselves. sent and acked hold
+ * the generation of the last broadcast signalled to, and
+ * acknowledged by, the thread; retry is set when the signal could
+ * not be queued and has to be sent again.
  */
 typedef struct registered_thread_s {
-    struct registered_thread_s *next, *prev;
     pthread_t thread;
+    pid_t tid;
+    int in_use;
+    int next;
+    int sent;
+    int acked;
+    int retry;
 } registered_thread_t;
 
+#define PSX_REGISTRY_MIN 16
+
+/*
+ * type to hold one caller's psx_syscall_batch() request. ok counts
+ * the steps that succeeded on the thread that ran them first; only
+ * those are broadcast. When combining, requests are pushed onto
+ * psx_tracker.combine.head and complete is set once another caller
+ * has performed it on this one's behalf.
+ */
+typedef struct psx_request_s {
+    struct psx_request_s *next;
+    psx_step_t *steps;
+    int n;
+    int ok;
+    int err;
+    int complete;
+} psx_request_t;
+
 static pthread_once_t psx_tracker_initialized = PTHREAD_ONCE_INIT;
 
 /*
@@ -54,49 +100,129 @@ static struct psx_tracker_s {
     int initialized;
     int psx_sig;
 
+    /*
+     * cmd describes the broadcast in progress. todo counts the
+     * threads yet to respond, plus one held by the initiator while
+     * it is still signalling threads. It is only ever changed
+     * atomically and it doubles as the futex the initiator sleeps
+     * on. Each broadcast has a new generation, gen, which is carried
+     * by its signals; the handler ignores signals for any other
+     * generation. busy counts the handlers looking at cmd, and
+     * last_tid is set by each responder.
+     */
     struct {
-	pthread_mutex_t mu;
-	pthread_cond_t cond;
-	long syscall_nr;
-	long arg1, arg2, arg3, arg4, arg5, arg6;
-	int six;
+	const psx_request_t *requests;
+	int gen;
 	int active;
 	int todo;
+	int busy;
+	pid_t last_tid;
     } cmd;
 
+    /* stats accumulates the counters reported by psx_get_stats() */
+    psx_stats_t stats;
+
+    /*
+     * combine holds the requests of callers waiting for
+     * psx_tracker.mu when flat combining is enabled. Whoever holds
+     * the lock performs all of them in a single broadcast.
+     */
+    struct {
+	int enabled;
+	psx_request_t *head;
+    } combine;
+
     struct sigaction sig_action;
-    registered_thread_t *root;
-} psx_tracker;
+
+    /*
+     * registry holds all of the registered threads. Slots [0, used)
+     * have been handed out at some point and free is the head of the
+     * list of those that are currently unused. The key holds (slot+1)
+     * for each registered thread so the slot is reclaimed by
+     * psx_unregister() when that thread exits.
+     */
+    struct {
+	registered_thread_t *slots;
+	int size;
+	int used;
+	int free;
+	pthread_key_t key;
+    } registry;
+} psx_tracker = {
+    .registry = { .free = -1 },
+};
 
 /*
- * psx_posix_syscall_handler performs the system call on the targeted
- * thread and decreases the outstanding syscall counter.
+ * PSX_SPIN_LOOPS is how many times the initiator of a broadcast polls
+ * for the last response before sleeping on the futex.
  */
-static void psx_posix_syscall_handler(int signum) {
-    if (!psx_tracker.cmd.active || signum != psx_tracker.psx_sig) {
+#define PSX_SPIN_LOOPS 1000
+
+/*
+ * PSX_RETRY_NS is how long the initiator sleeps before it sends
+ * again the signals that could not be queued.
+ */
+#define PSX_RETRY_NS 10000000L
+
+/*
+ * psx_self_slot is the registry slot of a thread that registered
+ * itself, so the signal handler can acknowledge broadcasts.
+ */
+static __thread int psx_self_slot = -1;
+
+/*
+ * psx_posix_syscall_handler performs the system calls on the targeted
+ * thread and decreases the outstanding syscall counter. Only async
+ * signal safe operations are used here: the last thread to respond
+ * wakes the initiator with a raw futex call.
+ */
+static void psx_posix_syscall_handler(int signum, siginfo_t *info,
+				      void *ignore) {
+    if (signum != psx_tracker.psx_sig || info->si_code != SI_QUEUE) {
+	return;
+    }
+    int gen = info->si_value.sival_int;
+    if (gen != __atomic_load_n(&psx_tracker.cmd.gen, __ATOMIC_SEQ_CST)) {
 	return;
     }
 
-    if (!psx_tracker.cmd.six) {
-	(void) syscall(psx_tracker.cmd.syscall_nr,
-		       psx_tracker.cmd.arg1,
-		       psx_tracker.cmd.arg2,
-		       psx_tracker.cmd.arg3);
-    } else {
-	(void) syscall(psx_tracker.cmd.syscall_nr,
-		       psx_tracker.cmd.arg1,
-		       psx_tracker.cmd.arg2,
-		       psx_tracker.cmd.arg3,
-		       psx_tracker.cmd.arg4,
-		       psx_tracker.cmd.arg5,
-		       psx_tracker.cmd.arg6);
+    int restore_errno = errno;
+    __atomic_add_fetch(&psx_tracker.cmd.busy, 1, __ATOMIC_SEQ_CST);
+    if (gen != __atomic_load_n(&psx_tracker.cmd.gen, __ATOMIC_SEQ_CST)
+	|| !__atomic_load_n(&psx_tracker.cmd.active, __ATOMIC_ACQUIRE)) {
+	goto done;
     }
 
-    pthread_mutex_lock(&psx_tracker.cmd.mu);
-    if (! --psx_tracker.cmd.todo) {
-	pthread_cond_signal(&psx_tracker.cmd.cond);
+    /*
+     * A second signal for a broadcast already handled by this thread
+     * does no work, but every signal queued was counted in todo.
+     */
+    int slot = psx_self_slot;
+    if (slot < 0 || __atomic_exchange_n(&psx_tracker.registry.slots[slot].acked,
+					gen, __ATOMIC_ACQ_REL) != gen) {
+	for (const psx_request_t *req = psx_tracker.cmd.requests; req;
+	     req = req->next) {
+	    for (int i = 0; i < req->ok; i++) {
+		const psx_step_t *step = &req->steps[i];
+		if (syscall(step->syscall_nr, step->arg[0], step->arg[1],
+			    step->arg[2], step->arg[3], step->arg[4],
+			    step->arg[5]) == -1) {
+		    break;
+		}
+	    }
+	}
+	__atomic_store_n(&psx_tracker.cmd.last_tid,
+			 (pid_t) syscall(SYS_gettid), __ATOMIC_RELAXED);
     }
-    pthread_mutex_unlock(&psx_tracker.cmd.mu);
+
+    if (__atomic_sub_fetch(&psx_tracker.cmd.todo, 1, __ATOMIC_ACQ_REL) == 0) {
+	(void) syscall(SYS_futex, &psx_tracker.cmd.todo, FUTEX_WAKE_PRIVATE,
+		       1, NULL, NULL, 0);
+    }
+
+done:
+    __atomic_sub_fetch(&psx_tracker.cmd.busy, 1, __ATOMIC_SEQ_CST);
+    errno = restore_errno;
 }
 
 long int psx_syscall3(long int syscall_nr,
@@ -110,38 +236,138 @@ long int psx_syscall6(long int syscall_nr,
     return psx_syscall(syscall_nr, arg1, arg2, arg3, arg4, arg5, arg6);
 }
 
+/*
+ * psx_slot_alloc pops a free slot from the registry, growing the
+ * slot array when none remain. It returns the slot index, or -1 if
+ * no memory is available. Called with psx_tracker.mu held.
+ */
+static int psx_slot_alloc(void) {
+    int slot = psx_tracker.registry.free;
+    if (slot >= 0) {
+	psx_tracker.registry.free = psx_tracker.registry.slots[slot].next;
+    } else {
+	if (psx_tracker.registry.used == psx_tracker.registry.size) {
+	    int size = 2 * psx_tracker.registry.size;
+	    if (size < PSX_REGISTRY_MIN) {
+		size = PSX_REGISTRY_MIN;
+	    }
+	    registered_thread_t *slots =
+		realloc(psx_tracker.registry.slots, size * sizeof(*slots));
+	    if (slots == NULL) {
+		return -1;
+	    }
+	    psx_tracker.registry.slots = slots;
+	    psx_tracker.registry.size = size;
+	}
+	slot = psx_tracker.registry.used++;
+    }
+    registered_thread_t *ref = &psx_tracker.registry.slots[slot];
+    memset(ref, 0, sizeof(*ref));
+    ref->in_use = 1;
+    ref->next = -1;
+    return slot;
+}
+
+/*
+ * psx_slot_free returns a slot to the free list. Called with
+ * psx_tracker.mu held.
+ */
+static void psx_slot_free(int slot) {
+    psx_tracker.registry.slots[slot].in_use = 0;
+    psx_tracker.registry.slots[slot].next = psx_tracker.registry.free;
+    psx_tracker.registry.free = slot;
+}
+
+/*
+ * psx_unregister is the destructor for the registry key. It runs as
+ * each registered thread exits and reclaims its slot.
+ */
+static void psx_unregister(void *value) {
+    int slot = (int) ((intptr_t) value - 1);
+
+    pthread_mutex_lock(&psx_tracker.mu);
+    /*
+     * The slot may already have been reclaimed by __psx_syscall() and
+     * handed to a different thread, so only free it if it is ours.
+     */
+    if (slot < psx_tracker.registry.used
+	&& psx_tracker.registry.slots[slot].in_use
+	&& pthread_equal(psx_tracker.registry.slots[slot].thread,
+			 pthread_self())) {
+	psx_slot_free(slot);
+    }
+    psx_self_slot = -1;
+    pthread_mutex_unlock(&psx_tracker.mu);
+}
+
 /*
  * psx_syscall_start initializes the subsystem.
  */
 static void psx_syscall_start(void) {
-    psx_tracker.initialized = 1;
-
     psx_tracker.psx_sig = 42; /* default signal number for syscall syncing */
-    psx_tracker.sig_action.sa_handler = psx_posix_syscall_handler;
+    psx_tracker.sig_action.sa_sigaction = psx_posix_syscall_handler;
     sigemptyset(&psx_tracker.sig_action.sa_mask);
-    psx_tracker.sig_action.sa_flags = 0;
+    psx_tracker.sig_action.sa_flags = SA_SIGINFO;
 
     sigaction(psx_tracker.psx_sig, &psx_tracker.sig_action, NULL);
 
+    (void) pthread_key_create(&psx_tracker.registry.key, psx_unregister);
+    __atomic_store_n(&psx_tracker.initialized, 1, __ATOMIC_RELEASE);
+
     share_psx_syscall(psx_syscall3, psx_syscall6);
+    share_psx_syscall_batch(psx_syscall_batch);
 }
 
-static void psx_do_registration(pthread_t thread) {
+/*
+ * psx_slot_find returns the slot of a registered thread, or -1.
+ * Called with psx_tracker.mu held.
+ */
+static int psx_slot_find(pthread_t thread) {
+    for (int i = 0; i < psx_tracker.registry.used; i++) {
+	registered_thread_t *ref = &psx_tracker.registry.slots[i];
+	if (ref->in_use && pthread_equal(ref->thread, thread)) {
+	    return i;
+	}
+    }
+    return -1;
+}
+
+/*
+ * psx_do_registration records thread in the registry, unless it is
+ * already registered. When the calling thread registers itself, its
+ * slot (perhaps one filled in earlier by another thread) is also
+ * reclaimed automatically when it exits. Called with psx_tracker.mu
+ * held.
+ */
+static int psx_do_registration(pthread_t thread) {
     int first_time = !psx_tracker.initialized;
     (void) pthread_once(&psx_tracker_initialized, psx_syscall_start);
 
     if (first_time) {
 	// First invocation, use recursion to register main() thread.
-	psx_do_registration(pthread_self());
+	(void) psx_do_registration(pthread_self());
+    }
+
+    int self = pthread_equal(thread, pthread_self());
+    if (self && pthread_getspecific(psx_tracker.registry.key) != NULL) {
+	return 0;
     }
 
-    registered_thread_t *node = calloc(1, sizeof(registered_thread_t));
-    node->next = psx_tracker.root;
-    if (node->next) {
-	node->next->prev = node;
+    int slot = psx_slot_find(thread);
+    if (slot < 0) {
+	slot = psx_slot_alloc();
+	if (slot < 0) {
+	    return -1;
+	}
+	psx_tracker.registry.slots[slot].thread = thread;
+    }
+    if (self) {
+	psx_tracker.registry.slots[slot].tid = (pid_t) syscall(SYS_gettid);
+	psx_self_slot = slot;
+	(void) pthread_setspecific(psx_tracker.registry.key,
+				   (void *) (intptr_t) (slot + 1));
     }
-    node->thread = thread;
-    psx_tracker.root = node;
+    return 0;
 }
 
 /*
@@ -168,12 +394,86 @@ static void psx_do_registration(pthread_t thread) {
  * explicitly use psx_register() for all threads not started with
  * psx_pthread_create().
  *
+ * A thread that registers itself, psx_register(pthread_self()), is
+ * unregistered automatically when it exits. Other registrations are
+ * dropped the first time psx_syscall() fails to signal the thread.
+ *
  * Note, there is no need to ever register the main() process thread.
  */
 void psx_register(pthread_t thread) {
     pthread_mutex_lock(&psx_tracker.mu);
-    psx_do_registration(thread);
+    (void) psx_do_registration(thread);
+    pthread_mutex_unlock(&psx_tracker.mu);
+}
+
+/*
+ * psx_starter_t carries the start arguments of a new thread through
+ * psx_start().
+ */
+typedef struct psx_starter_s {
+    void *(*fn)(void *);
+    void *arg;
+    int slot;
+} psx_starter_t;
+
+/*
+ * psx_start is the start routine of every thread created by
+ * psx_pthread_create(). It records its tid in the registry slot,
+ * already filled in by its creator, and arranges for the slot to be
+ * reclaimed when the thread exits.
+ */
+static void *psx_start(void *data) {
+    psx_starter_t starter = *(psx_starter_t *) data;
+    free(data);
+
+    pthread_mutex_lock(&psx_tracker.mu);
+    psx_tracker.registry.slots[starter.slot].tid = (pid_t) syscall(SYS_gettid);
     pthread_mutex_unlock(&psx_tracker.mu);
+    psx_self_slot = starter.slot;
+    (void) pthread_setspecific(psx_tracker.registry.key,
+			       (void *) (intptr_t) (starter.slot + 1));
+    return starter.fn(starter.arg);
+}
+
+/*
+ * psx_create_registered creates a thread with create_fn and registers
+ * it. The slot is allocated before the thread starts, and the thread
+ * cannot exit before its creator has filled in the slot because the
+ * destructor also needs psx_tracker.mu.
+ */
+static int psx_create_registered(int (*create_fn)(pthread_t *,
+						  const pthread_attr_t *,
+						  void *(*) (void *), void *),
+				 pthread_t *thread, const pthread_attr_t *attr,
+				 void *(*start_routine) (void *), void *arg) {
+    psx_starter_t *starter = malloc(sizeof(*starter));
+    if (starter == NULL) {
+	return EAGAIN;
+    }
+    starter->fn = start_routine;
+    starter->arg = arg;
+
+    pthread_mutex_lock(&psx_tracker.mu);
+    int ret = EAGAIN;
+    if (psx_do_registration(pthread_self()) != 0) {
+	goto done;
+    }
+    starter->slot = psx_slot_alloc();
+    if (starter->slot < 0) {
+	goto done;
+    }
+    ret = create_fn(thread, attr, psx_start, starter);
+    if (ret != 0) {
+	psx_slot_free(starter->slot);
+	goto done;
+    }
+    psx_tracker.registry.slots[starter->slot].thread = *thread;
+    starter = NULL;
+
+done:
+    pthread_mutex_unlock(&psx_tracker.mu);
+    free(starter);
+    return ret;
 }
 
 /* provide a prototype */
@@ -190,14 +490,8 @@ int psx_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
     if (pthread_create == __wrap_pthread_create) {
 	return __wrap_pthread_create(thread, attr, start_routine, arg);
     }
-
-    pthread_mutex_lock(&psx_tracker.mu);
-    int ret = pthread_create(thread, attr, start_routine, arg);
-    if (ret != -1) {
-	psx_do_registration(*thread);
-    }
-    pthread_mutex_unlock(&psx_tracker.mu);
-    return ret;
+    return psx_create_registered(pthread_create,
+				 thread, attr, start_routine, arg);
 }
 
 /*
@@ -206,13 +500,8 @@ int psx_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
  */
 int __wrap_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 			  void *(*start_routine) (void *), void *arg) {
-    pthread_mutex_lock(&psx_tracker.mu);
-    int ret = __real_pthread_create(thread, attr, start_routine, arg);
-    if (ret != -1) {
-	psx_do_registration(*thread);
-    }
-    pthread_mutex_unlock(&psx_tracker.mu);
-    return ret;
+    return psx_create_registered(__real_pthread_create,
+				 thread, attr, start_routine, arg);
 }
 
 /*
@@ -247,79 +536,380 @@ long int __psx_syscall(long int syscall_nr, ...) {
 	return -1;
     }
 
-    pthread_mutex_lock(&psx_tracker.mu);
-    long int ret;
-
-    psx_tracker.cmd.syscall_nr = syscall_nr;
-    psx_tracker.cmd.arg1 = count > 0 ? arg[0] : 0;
-    psx_tracker.cmd.arg2 = count > 1 ? arg[1] : 0;
-    psx_tracker.cmd.arg3 = count > 2 ? arg[2] : 0;
-    if (count > 3) {
-	psx_tracker.cmd.six = 1;
-	psx_tracker.cmd.arg1 = arg[3];
-	psx_tracker.cmd.arg2 = count > 4 ? arg[4] : 0;
-	psx_tracker.cmd.arg3 = count > 5 ? arg[5] : 0;
-
-	ret = syscall(syscall_nr,
-		      psx_tracker.cmd.arg1,
-		      psx_tracker.cmd.arg2,
-		      psx_tracker.cmd.arg3,
-		      psx_tracker.cmd.arg4,
-		      psx_tracker.cmd.arg5,
-		      psx_tracker.cmd.arg6);
-    } else {
-	psx_tracker.cmd.six = 0;
+    psx_step_t step = { .syscall_nr = syscall_nr };
+    for (int i = 0; i < count; i++) {
+	step.arg[i] = arg[i];
+    }
+    if (psx_syscall_batch(&step, 1) != 0) {
+	return -1;
+    }
+    return step.ret;
+}
+
+/*
+ * psx_set_combining enables or disables flat combining.
+ */
+int psx_set_combining(int enabled) {
+    return __atomic_exchange_n(&psx_tracker.combine.enabled, !!enabled,
+			       __ATOMIC_ACQ_REL);
+}
+
+/*
+ * psx_send queues the psx signal for generation gen to a registered
+ * thread. It returns 0 or the pthread_sigqueue() error.
+ */
+static int psx_send(registered_thread_t *ref, int gen) {
+    union sigval value = { .sival_int = gen };
+    return pthread_sigqueue(ref->thread, psx_tracker.psx_sig, value);
+}
+
+/*
+ * psx_next_gen returns the broadcast generation that follows gen,
+ * skipping 0 which no broadcast uses.
+ */
+static int psx_next_gen(int gen) {
+    unsigned next = (unsigned) gen + 1;
+    return next ? (int) next : 1;
+}
 
-	ret = syscall(syscall_nr,
-		      psx_tracker.cmd.arg1,
-		      psx_tracker.cmd.arg2,
-		      psx_tracker.cmd.arg3);
+/*
+ * psx_elapsed_ns returns the nanoseconds from start to end.
+ */
+static long psx_elapsed_ns(const struct timespec *start,
+			   const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000L
+	+ (end->tv_nsec - start->tv_nsec);
+}
+
+/*
+ * psx_inspect looks up the kernel scheduling state of a thread (the
+ * third field of /proc/self/task/<tid>/stat) and whether its SigBlk
+ * mask blocks the psx signal.
+ */
+static void psx_inspect(psx_stuck_t *stuck) {
+    char path[64], buf[4096];
+    ssize_t n;
+    int fd;
+
+    stuck->state = '?';
+    stuck->blocked = -1;
+    if (stuck->tid <= 0) {
+	return;
     }
 
-    if (ret == -1 || !psx_tracker.initialized) {
-	goto defer;
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", stuck->tid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n > 0) {
+	    buf[n] = '\0';
+	    char *p = strrchr(buf, ')');
+	    if (p && p[1] == ' ' && p[2]) {
+		stuck->state = p[2];
+	    }
+	}
     }
 
-    int restore_errno = errno;
-    psx_tracker.cmd.active = 1;
+    snprintf(path, sizeof(path), "/proc/self/task/%d/status", stuck->tid);
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n > 0) {
+	    buf[n] = '\0';
+	    char *p = strstr(buf, "\nSigBlk:");
+	    if (p) {
+		unsigned long long mask = strtoull(p + 8, NULL, 16);
+		stuck->blocked = (mask >> (psx_tracker.psx_sig - 1)) & 1;
+	    }
+	}
+    }
+}
+
+/*
+ * psx_broadcast has every registered thread, other than the calling
+ * one, perform the list of requests and waits for them all to
+ * finish. Called with psx_tracker.mu held.
+ *
+ * If deadline is not NULL and passes before every thread has
+ * responded, the broadcast is abandoned: threads that have not yet
+ * started on it never will. Up to *nstuck of them are described in
+ * stuck[], *nstuck is set to how many there were, and ETIMEDOUT is
+ * returned. Otherwise, the return value is 0.
+ */
+static int psx_broadcast(const psx_request_t *requests,
+			 const struct timespec *deadline,
+			 psx_stuck_t *stuck, int *nstuck) {
+    struct timespec start, now;
+    int retrying = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int gen = psx_next_gen(__atomic_load_n(&psx_tracker.cmd.gen,
+					   __ATOMIC_RELAXED));
+    psx_tracker.cmd.requests = requests;
+    __atomic_store_n(&psx_tracker.cmd.todo, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&psx_tracker.cmd.active, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&psx_tracker.cmd.gen, gen, __ATOMIC_SEQ_CST);
 
     pthread_t self = pthread_self();
-    registered_thread_t *next = NULL;
-    for (registered_thread_t *ref = psx_tracker.root; ref; ref = next) {
-	next = ref->next;
-	if (ref->thread == self) {
+    for (int i = 0; i < psx_tracker.registry.used; i++) {
+	registered_thread_t *ref = &psx_tracker.registry.slots[i];
+	if (!ref->in_use || pthread_equal(ref->thread, self)) {
 	    continue;
 	}
-	if (pthread_kill(ref->thread, psx_tracker.psx_sig) == 0) {
-	    pthread_mutex_lock(&psx_tracker.cmd.mu);
-	    psx_tracker.cmd.todo++;
-	    pthread_mutex_unlock(&psx_tracker.cmd.mu);
+	ref->sent = gen;
+	__atomic_add_fetch(&psx_tracker.cmd.todo, 1, __ATOMIC_RELAXED);
+	int err = psx_send(ref, gen);
+	if (err == 0) {
 	    continue;
 	}
+	if (err == EAGAIN) {
+	    /* the signal queue is full, try again shortly */
+	    ref->retry = 1;
+	    retrying++;
+	    continue;
+	}
+	__atomic_sub_fetch(&psx_tracker.cmd.todo, 1, __ATOMIC_RELAXED);
+
+	/* need to reclaim the slot of a now invalid thread id */
+	psx_slot_free(i);
+    }
 
-	/* need to remove now invalid thread id from linked list */
-	if (ref == psx_tracker.root) {
-	    psx_tracker.root = next;
-	} else if (ref->prev) {
-	    ref->prev->next = next;
+    /* drop the initiator's count, then wait for the responders */
+    int todo = __atomic_sub_fetch(&psx_tracker.cmd.todo, 1, __ATOMIC_ACQ_REL);
+    for (int spin = 0; todo && spin < PSX_SPIN_LOOPS; spin++) {
+	todo = __atomic_load_n(&psx_tracker.cmd.todo, __ATOMIC_ACQUIRE);
+    }
+    while (todo) {
+	long wait_ns = retrying ? PSX_RETRY_NS : -1;
+	if (deadline) {
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    long remaining = psx_elapsed_ns(&now, deadline);
+	    if (remaining <= 0) {
+		break;
+	    }
+	    if (wait_ns < 0 || remaining < wait_ns) {
+		wait_ns = remaining;
+	    }
 	}
-	if (next) {
-	    next->prev = ref->prev;
+
+	struct timespec timeout = {
+	    .tv_sec = wait_ns / 1000000000L,
+	    .tv_nsec = wait_ns % 1000000000L,
+	};
+	(void) syscall(SYS_futex, &psx_tracker.cmd.todo, FUTEX_WAIT_PRIVATE,
+		       todo, wait_ns < 0 ? NULL : &timeout, NULL, 0);
+
+	for (int i = 0; retrying && i < psx_tracker.registry.used; i++) {
+	    registered_thread_t *ref = &psx_tracker.registry.slots[i];
+	    if (!ref->in_use || !ref->retry) {
+		continue;
+	    }
+	    psx_tracker.stats.retries++;
+	    int err = psx_send(ref, gen);
+	    if (err == EAGAIN) {
+		continue;
+	    }
+	    ref->retry = 0;
+	    retrying--;
+	    if (err != 0) {
+		__atomic_sub_fetch(&psx_tracker.cmd.todo, 1, __ATOMIC_RELAXED);
+		psx_slot_free(i);
+	    }
 	}
-	free(ref);
+	todo = __atomic_load_n(&psx_tracker.cmd.todo, __ATOMIC_ACQUIRE);
     }
 
-    pthread_mutex_lock(&psx_tracker.cmd.mu);
-    while (psx_tracker.cmd.todo) {
-	pthread_cond_wait(&psx_tracker.cmd.cond, &psx_tracker.cmd.mu);
+    __atomic_store_n(&psx_tracker.cmd.active, 0, __ATOMIC_RELEASE);
+    psx_tracker.stats.broadcasts++;
+
+    if (todo == 0) {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	unsigned long elapsed = psx_elapsed_ns(&start, &now);
+	if (elapsed > psx_tracker.stats.slowest_ns) {
+	    psx_tracker.stats.slowest_ns = elapsed;
+	    psx_tracker.stats.slowest_tid =
+		__atomic_load_n(&psx_tracker.cmd.last_tid, __ATOMIC_RELAXED);
+	}
+	return 0;
     }
-    pthread_mutex_unlock(&psx_tracker.cmd.mu);
 
-    errno = restore_errno;
-defer:
+    /*
+     * Abandon the broadcast: signals still pending for this
+     * generation are ignored from now on, and any handler already
+     * working on it is allowed to finish.
+     */
+    __atomic_store_n(&psx_tracker.cmd.gen, psx_next_gen(gen),
+		     __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&psx_tracker.cmd.busy, __ATOMIC_SEQ_CST)) {
+	sched_yield();
+    }
+    psx_tracker.stats.timeouts++;
+
+    int count = 0;
+    for (int i = 0; i < psx_tracker.registry.used; i++) {
+	registered_thread_t *ref = &psx_tracker.registry.slots[i];
+	if (!ref->in_use || ref->sent != gen) {
+	    continue;
+	}
+	ref->retry = 0;
+	if (ref->tid != 0
+	    && __atomic_load_n(&ref->acked, __ATOMIC_ACQUIRE) == gen) {
+	    continue;
+	}
+	if (count < *nstuck) {
+	    stuck[count].thread = ref->thread;
+	    stuck[count].tid = ref->tid;
+	    psx_inspect(&stuck[count]);
+	}
+	count++;
+    }
+    *nstuck = count;
+    return ETIMEDOUT;
+}
 
-    psx_tracker.cmd.active = 0;
+/*
+ * psx_perform performs a list of requests on the current thread, each
+ * stopping at its first failure, and then has all of the (other)
+ * registered threads perform the steps that succeeded in a single
+ * broadcast. Called with psx_tracker.mu held. The deadline, stuck and
+ * nstuck arguments are passed to psx_broadcast(), whose result is
+ * returned (0 if there was nothing to broadcast).
+ */
+static int psx_perform(psx_request_t *requests,
+		       const struct timespec *deadline,
+		       psx_stuck_t *stuck, int *nstuck) {
+    int any = 0;
+
+    for (psx_request_t *req = requests; req; req = req->next) {
+	for (req->ok = 0; req->ok < req->n; req->ok++) {
+	    psx_step_t *step = &req->steps[req->ok];
+	    step->ret = syscall(step->syscall_nr, step->arg[0], step->arg[1],
+				step->arg[2], step->arg[3], step->arg[4],
+				step->arg[5]);
+	    step->err = step->ret == -1 ? errno : 0;
+	    if (step->err) {
+		req->err = step->err;
+		break;
+	    }
+	}
+	any |= req->ok;
+    }
+    if (any && psx_tracker.initialized) {
+	return psx_broadcast(requests, deadline, stuck, nstuck);
+    }
+    if (nstuck) {
+	*nstuck = 0;
+    }
+    return 0;
+}
+
+/*
+ * psx_combine performs, in arrival order, all of the requests pushed
+ * by combining callers so far. Called with psx_tracker.mu held.
+ */
+static void psx_combine(void) {
+    psx_request_t *pushed = __atomic_exchange_n(&psx_tracker.combine.head,
+						NULL, __ATOMIC_ACQ_REL);
+    psx_request_t *requests = NULL;
+
+    while (pushed) {
+	psx_request_t *next = pushed->next;
+	pushed->next = requests;
+	requests = pushed;
+	pushed = next;
+    }
+
+    (void) psx_perform(requests, NULL, NULL, NULL);
+
+    while (requests) {
+	psx_request_t *next = requests->next;
+	requests->complete = 1;
+	requests = next;
+    }
+}
+
+/*
+ * psx_syscall_batch performs a sequence of syscalls on the current
+ * thread, stopping at the first failure, and then has all of the
+ * (other) registered threads perform the ones that succeeded in a
+ * single broadcast.
+ *
+ * With combining enabled, a thread that registered itself publishes
+ * its request before waiting for the lock, and the lock holder
+ * performs it along with any others. Such a caller finds its request
+ * complete when it gets the lock. The syscalls of a combined request
+ * are made on its own thread by the broadcast, so this is limited to
+ * threads that psx knows are registered.
+ */
+int psx_syscall_batch(psx_step_t *steps, int n) {
+    if (n < 0 || (n > 0 && steps == NULL)) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    int restore_errno = errno;
+    psx_request_t req = { .steps = steps, .n = n };
+
+    if (__atomic_load_n(&psx_tracker.combine.enabled, __ATOMIC_ACQUIRE)
+	&& __atomic_load_n(&psx_tracker.initialized, __ATOMIC_ACQUIRE)
+	&& pthread_getspecific(psx_tracker.registry.key) != NULL) {
+	req.next = __atomic_load_n(&psx_tracker.combine.head,
+				   __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&psx_tracker.combine.head,
+					    &req.next, &req, 1,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED)) {
+	}
+
+	pthread_mutex_lock(&psx_tracker.mu);
+	if (!req.complete) {
+	    psx_combine();
+	}
+	pthread_mutex_unlock(&psx_tracker.mu);
+    } else {
+	pthread_mutex_lock(&psx_tracker.mu);
+	(void) psx_perform(&req, NULL, NULL, NULL);
+	pthread_mutex_unlock(&psx_tracker.mu);
+    }
+
+    errno = req.err ? req.err : restore_errno;
+    return req.err ? -1 : 0;
+}
+
+/*
+ * psx_syscall_timed is psx_syscall_batch() with a deadline for the
+ * other threads to respond. It never combines requests.
+ */
+int psx_syscall_timed(const struct timespec *deadline,
+		      psx_step_t *steps, int n,
+		      psx_stuck_t *stuck, int *nstuck) {
+    if (deadline == NULL || n < 0 || (n > 0 && steps == NULL)
+	|| nstuck == NULL || *nstuck < 0 || (*nstuck > 0 && stuck == NULL)) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    int restore_errno = errno;
+    psx_request_t req = { .steps = steps, .n = n };
+
+    pthread_mutex_lock(&psx_tracker.mu);
+    int timedout = psx_perform(&req, deadline, stuck, nstuck);
     pthread_mutex_unlock(&psx_tracker.mu);
 
-    return ret;
+    if (timedout) {
+	errno = timedout;
+	return -1;
+    }
+    errno = req.err ? req.err : restore_errno;
+    return req.err ? -1 : 0;
+}
+
+/*
+ * psx_get_stats copies the broadcast counters.
+ */
+void psx_get_stats(psx_stats_t *stats) {
+    pthread_mutex_lock(&psx_tracker.mu);
+    *stats = psx_tracker.stats;
+    pthread_mutex_unlock(&psx_tracker.mu);
 }
@@ -22,8 +22,6 @@
 #define USER_CAP_FILE           "/etc/security/capability.conf"
 #define CAP_FILE_BUFFER_SIZE    4096
 #define CAP_FILE_DELIMITERS     " \t\n"
-#define CAP_COMBINED_FORMAT     "%s all-i %s+i"
-#define CAP_DROP_ALL            "%s all-i"
 
 struct pam_cap_s {
     int debug;
@@ -36,7 +34,7 @@ struct pam_cap_s {
 static char *read_capabilities_for_user(const char *user, const char *source)
 {
     char *cap_string = NULL;
-    char buffer[CAP_FILE_BUFFER_SIZE], *line;
+    char buffer[CAP_FILE_BUFFER_SIZE], *line, *save;
     FILE *cap_file;
 
     cap_file = fopen(source, "r");
@@ -49,7 +47,7 @@ static char *read_capabilities_for_user(const char *user, const char *source)
 	int found_one = 0;
 	const char *cap_text;
 
-	cap_text = strtok(line, CAP_FILE_DELIMITERS);
+	cap_text = strtok_r(line, CAP_FILE_DELIMITERS, &save);
 
 	if (cap_text == NULL) {
 	    D(("empty line"));
@@ -60,7 +58,7 @@ static char *read_capabilities_for_user(const char *user, const char *source)
 	    continue;
 	}
 
-	while ((line = strtok(NULL, CAP_FILE_DELIMITERS))) {
+	while ((line = strtok_r(NULL, CAP_FILE_DELIMITERS, &save))) {
 
 	    if (strcmp("*", line) == 0) {
 		D(("wildcard matched"));
@@ -95,6 +93,41 @@ static char *read_capabilities_for_user(const char *user, const char *source)
     return cap_string;
 }
 
+/*
+ * Convert a comma separated list of capability names into a
+ * capability set with just those capabilities inheritable. The list
+ * is parsed by cap_from_text() as "<names>=i", so it may not carry
+ * operators of its own.
+ */
+
+static cap_t inheritable_caps(const char *conf_icaps)
+{
+    size_t len = strlen(conf_icaps);
+    cap_t icaps;
+    char *text;
+
+    if (len == 0 || strcspn(conf_icaps, "=+- \t\n") != len) {
+	D(("unrecognized capabilities [%s]", conf_icaps));
+	return NULL;
+    }
+
+    text = malloc(len + sizeof("=i"));
+    if (text == NULL) {
+	D(("unable to allocate inheritable capabilities - no memory"));
+	return NULL;
+    }
+    memcpy(text, conf_icaps, len);
+    memcpy(text + len, "=i", sizeof("=i"));
+
+    icaps = cap_from_text(text);
+    if (icaps == NULL) {
+	D(("unrecognized capabilities [%s]", conf_icaps));
+    }
+    _pam_drop(text);
+
+    return icaps;
+}
+
 /*
  * Set capabilities for current process to match the current
  * permitted+executable sets combined with the configured inheritable
@@ -103,11 +136,8 @@ static char *read_capabilities_for_user(const char *user, const char *source)
 
 static int set_capabilities(struct pam_cap_s *cs)
 {
-    cap_t cap_s;
-    ssize_t length = 0;
+    cap_t cap_s, conf_s;
     char *conf_icaps;
-    char *proc_epcaps;
-    char *combined_caps;
     int ok = 0;
 
     cap_s = cap_get_proc();
@@ -126,41 +156,27 @@ static int set_capabilities(struct pam_cap_s *cs)
 	goto cleanup_cap_s;
     }
 
-    proc_epcaps = cap_to_text(cap_s, &length);
-    if (proc_epcaps == NULL) {
-	D(("unable to convert process capabilities to text"));
-	goto cleanup_icaps;
-    }
-
     /*
-     * This is a pretty inefficient way to combine
-     * capabilities. However, it seems to be the most straightforward
-     * one, given the limitations of the POSIX.1e draft spec. The spec
-     * is optimized for applications that know the capabilities they
-     * want to manipulate at compile time.
+     * The process keeps its permitted and effective capabilities,
+     * and its inheritable set is replaced by the configured one
+     * ("all" meaning no change).
      */
 
-    combined_caps = malloc(1+strlen(CAP_COMBINED_FORMAT)
-			   +strlen(proc_epcaps)+strlen(conf_icaps));
-    if (combined_caps == NULL) {
-	D(("unable to combine capabilities into one string - no memory"));
-	goto cleanup_epcaps;
-    }
-
-    if (!strcmp(conf_icaps, "none")) {
-	sprintf(combined_caps, CAP_DROP_ALL, proc_epcaps);
-    } else if (!strcmp(conf_icaps, "all")) {
-	/* no change */
-	sprintf(combined_caps, "%s", proc_epcaps);
-    } else {
-	sprintf(combined_caps, CAP_COMBINED_FORMAT, proc_epcaps, conf_icaps);
+    if (strcmp(conf_icaps, "all")) {
+	conf_s = NULL;
+	if (strcmp(conf_icaps, "none")) {
+	    conf_s = inheritable_caps(conf_icaps);
+	    if (conf_s == NULL) {
+		D(("no capabilies to set"));
+		goto cleanup_icaps;
+	    }
+	}
+	cap_clear_flag(cap_s, CAP_INHERITABLE);
+	if (conf_s != NULL) {
+	    cap_merge_flag(cap_s, conf_s, CAP_INHERITABLE);
+	    cap_free(conf_s);
+	}
     }
-    D(("combined_caps=[%s]", combined_caps));
-
-    cap_free(cap_s);
-    cap_s = cap_from_text(combined_caps);
-    _pam_overwrite(combined_caps);
-    _pam_drop(combined_caps);
 
 #ifdef DEBUG
     {
@@ -170,18 +186,13 @@ static int set_capabilities(struct pam_cap_s *cs)
     }
 #endif /* DEBUG */
 
-    if (cap_s == NULL) {
-	D(("no capabilies to set"));
-    } else if (cap_set_proc(cap_s) == 0) {
+    if (cap_set_proc(cap_s) == 0) {
 	D(("capabilities were set correctly"));
 	ok = 1;
     } else {
 	D(("failed to set specified capabilities: %s", strerror(errno)));
     }
 
-cleanup_epcaps:
-    cap_free(proc_epcaps);
-
 cleanup_icaps:
     _pam_overwrite(conf_icaps);
     _pam_drop(conf_icaps);
@@ -40,32 +40,68 @@ static char *binary(unsigned long value)
     return string + i;
 }
 
-static void display_prctl_set(const char *name, int (*fn)(cap_value_t))
+static void display_mask_set(const char *name, uint64_t mask, int valid)
 {
-    unsigned cap;
+    cap_value_t cap;
     const char *sep;
-    int set;
 
     printf("%s set =", name);
-    for (sep = "", cap=0; (set = fn(cap)) >= 0; cap++) {
-	char *ptr;
-	if (!set) {
+    if (!valid) {
+	printf(" <unsupported>\n");
+	return;
+    }
+    for (sep = "", cap = 0; cap < 64; cap++) {
+	const char *ptr;
+
+	if (!(mask & (1ULL << cap))) {
 	    continue;
 	}
-
-	ptr = cap_to_name(cap);
+	ptr = cap_name_static(cap);
 	if (ptr == NULL) {
 	    printf("%s%u", sep, cap);
 	} else {
 	    printf("%s%s", sep, ptr);
-	    cap_free(ptr);
 	}
 	sep = ",";
     }
-    if (!cap) {
-	printf(" <unsupported>\n");
-    } else {
-	printf("\n");
+    printf("\n");
+}
+
+/*
+ * Snapshot the capability state of the calling thread, falling back
+ * to a prctl() per capability for whatever could not be read from
+ * /proc (for example, because it is not mounted).
+ */
+static void get_snapshot(cap_snapshot_t *snap)
+{
+    cap_value_t cap;
+    int set;
+
+    if (cap_get_snapshot(0, snap) != 0) {
+	memset(snap, 0, sizeof(*snap));
+    }
+    if (!(snap->valid & CAP_SNAPSHOT_BOUNDING)) {
+	snap->bounding = 0;
+	for (cap = 0; cap < 64 && (set = cap_get_bound(cap)) >= 0; cap++) {
+	    snap->bounding |= (uint64_t) !!set << cap;
+	}
+	if (cap) {
+	    snap->valid |= CAP_SNAPSHOT_BOUNDING;
+	}
+    }
+    if (!(snap->valid & CAP_SNAPSHOT_AMBIENT)) {
+	snap->ambient = 0;
+	for (cap = 0; cap < 64 && (set = cap_get_ambient(cap)) >= 0; cap++) {
+	    snap->ambient |= (uint64_t) !!set << cap;
+	}
+	if (cap) {
+	    snap->valid |= CAP_SNAPSHOT_AMBIENT;
+	}
+    }
+    if (!(snap->valid & CAP_SNAPSHOT_SECUREBITS)
+	&& (set = prctl(PR_GET_SECUREBITS)) >= 0) {
+	snap->securebits = set;
+	snap->valid |= CAP_SNAPSHOT_SECUREBITS;
     }
 }
 
@@ -80,6 +116,7 @@ static void arg_print(void)
     gid_t groups[MAX_GROUPS], gid;
     uid_t uid;
     struct passwd *u;
+    cap_snapshot_t snap;
 
     all = cap_get_proc();
     text = cap_to_text(all, NULL);
@@ -87,9 +124,13 @@ static void arg_print(void)
     cap_free(text);
     cap_free(all);
 
-    display_prctl_set("Bounding", cap_get_bound);
-    display_prctl_set("Ambient", cap_get_ambient);
-    set = prctl(PR_GET_SECUREBITS);
+    /* one read of /proc, rather than a prctl() per capability */
+    get_snapshot(&snap);
+    display_mask_set("Bounding", snap.bounding,
+		     snap.valid & CAP_SNAPSHOT_BOUNDING);
+    display_mask_set("Ambient", snap.ambient,
+		     snap.valid & CAP_SNAPSHOT_AMBIENT);
+    set = (snap.valid & CAP_SNAPSHOT_SECUREBITS) ? (int) snap.securebits : -1;
     if (set >= 0) {
 	const char *b;
 	b = binary(set);  /* use verilog convention for binary string */
@@ -140,170 +181,124 @@ static void arg_print(void)
 static const cap_value_t raise_setpcap[1] = { CAP_SETPCAP };
 static const cap_value_t raise_chroot[1] = { CAP_SYS_CHROOT };
 
-static void push_pcap(cap_t *orig_p, cap_t *raised_for_setpcap_p)
+/*
+ * Parse a comma separated list of capability names into a set with
+ * just those capabilities raised in flag. The list is handed to
+ * cap_from_text() as "<names>=<flag>", so it may not carry operators
+ * of its own.
+ */
+static cap_t names_to_set(const char *arg_names, cap_flag_t flag)
 {
-    /*
-     * We need to do this here because --inh=XXX may have reset
-     * orig and it isn't until we are within the --drop code that
-     * we know what the prevailing (orig) pI value is.
-     */
-    *orig_p = cap_get_proc();
-    if (NULL == *orig_p) {
-	perror("Capabilities not available");
-	exit(1);
-    }
+    static const char flag_names[] = { 'e', 'p', 'i' };
+    size_t len = strlen(arg_names);
+    cap_t set = NULL;
+    char *text;
 
-    *raised_for_setpcap_p = cap_dup(*orig_p);
-    if (NULL == *raised_for_setpcap_p) {
-	fprintf(stderr, "modification requires CAP_SETPCAP\n");
-	exit(1);
+    if (len && strcspn(arg_names, "=+- \t\n") == len) {
+	text = malloc(len + 3);
+	if (text == NULL) {
+	    fprintf(stderr, "failed to allocate names\n");
+	    exit(1);
+	}
+	memcpy(text, arg_names, len);
+	text[len] = '=';
+	text[len + 1] = flag_names[flag];
+	text[len + 2] = '\0';
+	set = cap_from_text(text);
+	free(text);
     }
-    if (cap_set_flag(*raised_for_setpcap_p, CAP_EFFECTIVE, 1,
-		     raise_setpcap, CAP_SET) != 0) {
-	perror("unable to select CAP_SETPCAP");
+    if (set == NULL) {
+	fprintf(stderr, "capabilities [%s] are unknown to libcap\n", arg_names);
 	exit(1);
     }
-}
 
-static void pop_pcap(cap_t orig, cap_t raised_for_setpcap)
-{
-    cap_free(raised_for_setpcap);
-    cap_free(orig);
+    return set;
 }
 
-static void arg_drop(const char *arg_names)
+/*
+ * Convert a comma separated list of capability names, or "all" (the
+ * capabilities supported by the running kernel), into a mask.
+ */
+static uint64_t names_to_mask(const char *arg_names)
 {
-    char *ptr;
-    cap_t orig, raised_for_setpcap;
-    char *names;
+    uint64_t mask = 0;
+    cap_value_t cap;
+    cap_t set;
 
-    push_pcap(&orig, &raised_for_setpcap);
     if (strcmp("all", arg_names) == 0) {
-	unsigned j = 0;
-	while (CAP_IS_SUPPORTED(j)) {
-	    int status;
-	    if (cap_set_proc(raised_for_setpcap) != 0) {
-		perror("unable to raise CAP_SETPCAP for BSET changes");
-		exit(1);
-	    }
-	    status = cap_drop_bound(j);
-	    if (cap_set_proc(orig) != 0) {
-		perror("unable to lower CAP_SETPCAP post BSET change");
-		exit(1);
-	    }
-	    if (status != 0) {
-		char *name_ptr;
+	cap_value_t max = cap_max_bits();
 
-		name_ptr = cap_to_name(j);
-		fprintf(stderr, "Unable to drop bounding capability [%s]\n",
-			name_ptr);
-		cap_free(name_ptr);
-		exit(1);
-	    }
-	    j++;
-	}
-	pop_pcap(orig, raised_for_setpcap);
-	return;
+	return max < 64 ? (1ULL << max) - 1 : ~0ULL;
     }
 
-    names = strdup(arg_names);
-    if (NULL == names) {
-	fprintf(stderr, "failed to allocate names\n");
-	exit(1);
-    }
-    for (ptr = names; (ptr = strtok(ptr, ",")); ptr = NULL) {
-	/* find name for token */
-	cap_value_t cap;
-	int status;
+    set = names_to_set(arg_names, CAP_PERMITTED);
+    for (cap = 0; cap < 64; cap++) {
+	cap_flag_value_t value;
 
-	if (cap_from_name(ptr, &cap) != 0) {
-	    fprintf(stderr, "capability [%s] is unknown to libcap\n", ptr);
-	    exit(1);
-	}
-	if (cap_set_proc(raised_for_setpcap) != 0) {
-	    perror("unable to raise CAP_SETPCAP for BSET changes");
-	    exit(1);
-	}
-	status = cap_drop_bound(cap);
-	if (cap_set_proc(orig) != 0) {
-	    perror("unable to lower CAP_SETPCAP post BSET change");
-	    exit(1);
-	}
-	if (status != 0) {
-	    fprintf(stderr, "failed to drop [%s=%u]\n", ptr, cap);
-	    exit(1);
+	if (cap_get_flag(set, cap, CAP_PERMITTED, &value) == 0 && value) {
+	    mask |= 1ULL << cap;
 	}
     }
-    pop_pcap(orig, raised_for_setpcap);
-    free(names);
+    cap_free(set);
+
+    return mask;
 }
 
-static void arg_change_amb(const char *arg_names, cap_flag_value_t set)
+/*
+ * Name the capabilities of mask on stderr.
+ */
+static void display_mask_names(uint64_t mask)
 {
-    char *ptr;
-    cap_t orig, raised_for_setpcap;
-    char *names;
+    const char *sep = "";
+    cap_value_t cap;
 
-    push_pcap(&orig, &raised_for_setpcap);
-    if (strcmp("all", arg_names) == 0) {
-	unsigned j = 0;
-	while (CAP_IS_SUPPORTED(j)) {
-	    int status;
-	    if (cap_set_proc(raised_for_setpcap) != 0) {
-		perror("unable to raise CAP_SETPCAP for AMBIENT changes");
-		exit(1);
-	    }
-	    status = cap_set_ambient(j, set);
-	    if (cap_set_proc(orig) != 0) {
-		perror("unable to lower CAP_SETPCAP post AMBIENT change");
-		exit(1);
-	    }
-	    if (status != 0) {
-		char *name_ptr;
+    for (cap = 0; cap < 64; cap++) {
+	if (mask & (1ULL << cap)) {
+	    char *name_ptr = cap_to_name(cap);
 
-		name_ptr = cap_to_name(j);
-		fprintf(stderr, "Unable to %s ambient capability [%s]\n",
-			set == CAP_CLEAR ? "clear":"raise", name_ptr);
-		cap_free(name_ptr);
-		exit(1);
-	    }
-	    j++;
+	    fprintf(stderr, "%s%s", sep, name_ptr);
+	    cap_free(name_ptr);
+	    sep = ",";
 	}
-	pop_pcap(orig, raised_for_setpcap);
-	return;
     }
+}
 
-    names = strdup(arg_names);
-    if (NULL == names) {
-	fprintf(stderr, "failed to allocate names\n");
+static void arg_drop(const char *arg_names)
+{
+    uint64_t drop = names_to_mask(arg_names);
+    cap_snapshot_t snap;
+
+    if (cap_drop_bound_mask(drop) != 0) {
+	int err = errno;
+
+	fprintf(stderr, "Unable to drop bounding capabilities [");
+	get_snapshot(&snap);
+	if (snap.valid & CAP_SNAPSHOT_BOUNDING) {
+	    display_mask_names(drop & snap.bounding);
+	}
+	fprintf(stderr, "] (%s)\n", strerror(err));
 	exit(1);
     }
-    for (ptr = names; (ptr = strtok(ptr, ",")); ptr = NULL) {
-	/* find name for token */
-	cap_value_t cap;
-	int status;
+}
 
-	if (cap_from_name(ptr, &cap) != 0) {
-	    fprintf(stderr, "capability [%s] is unknown to libcap\n", ptr);
-	    exit(1);
-	}
-	if (cap_set_proc(raised_for_setpcap) != 0) {
-	    perror("unable to raise CAP_SETPCAP for AMBIENT changes");
-	    exit(1);
-	}
-	status = cap_set_ambient(cap, set);
-	if (cap_set_proc(orig) != 0) {
-	    perror("unable to lower CAP_SETPCAP post AMBIENT change");
-	    exit(1);
-	}
-	if (status != 0) {
-	    fprintf(stderr, "failed to %s ambient [%s=%u]\n",
-		    set == CAP_CLEAR ? "clear":"raise", ptr, cap);
-	    exit(1);
-	}
+static void arg_change_amb(const char *arg_names, cap_flag_value_t set)
+{
+    uint64_t mask = names_to_mask(arg_names), failed;
+
+    if (set == CAP_SET) {
+	failed = cap_set_ambient_mask(mask, 0);
+    } else {
+	failed = cap_set_ambient_mask(0, mask);
+    }
+    if (failed) {
+	int err = errno;
+
+	fprintf(stderr, "Unable to %s ambient capabilities [",
+		set == CAP_CLEAR ? "clear":"raise");
+	display_mask_names(failed);
+	fprintf(stderr, "] (%s)\n", strerror(err));
+	exit(1);
     }
-    pop_pcap(orig, raised_for_setpcap);
-    free(names);
 }
 
 int main(int argc, char *argv[], char *envp[])
@@ -332,8 +327,6 @@ int main(int argc, char *argv[], char *envp[])
 	    }
 	} else if (!strncmp("--inh=", argv[i], 6)) {
 	    cap_t all, raised_for_setpcap;
-	    char *text;
-	    char *ptr;
 
 	    all = cap_get_proc();
 	    if (all == NULL) {
@@ -353,30 +346,15 @@ int main(int argc, char *argv[], char *envp[])
 		raised_for_setpcap = NULL;
 	    }
 
-	    text = cap_to_text(all, NULL);
-	    cap_free(all);
-	    if (text == NULL) {
-		perror("Fatal error concerning process capabilities");
-		exit(1);
-	    }
-	    ptr = malloc(10 + strlen(argv[i]+6) + strlen(text));
-	    if (ptr == NULL) {
-		perror("Out of memory for inh set");
-		exit(1);
-	    }
 	    if (argv[i][6] && strcmp("none", argv[i]+6)) {
-		sprintf(ptr, "%s %s+i", text, argv[i]+6);
-	    } else {
-		strcpy(ptr, text);
-	    }
+		cap_t inh = names_to_set(argv[i]+6, CAP_INHERITABLE);
 
-	    all = cap_from_text(ptr);
-	    if (all == NULL) {
-		perror("Fatal error internalizing capabilities");
-		exit(1);
+		if (cap_merge_flag(all, inh, CAP_INHERITABLE) != 0) {
+		    perror("Fatal error internalizing capabilities");
+		    exit(1);
+		}
+		cap_free(inh);
 	    }
-	    cap_free(text);
-	    free(ptr);
 
 	    if (raised_for_setpcap != NULL) {
 		/*
@@ -572,7 +550,7 @@ int main(int argc, char *argv[], char *envp[])
 		exit(1);
 	    }
         } else if (!strncmp("--groups=", argv[i], 9)) {
-	  char *ptr, *buf;
+	  char *ptr, *save, *buf;
 	  long length, max_groups;
 	  gid_t *group_list;
 	  int g_count;
@@ -592,7 +570,7 @@ int main(int argc, char *argv[], char *envp[])
 	  }
 
 	  g_count = 0;
-	  for (ptr = argv[i] + 9; (ptr = strtok(ptr, ","));
+	  for (ptr = argv[i] + 9; (ptr = strtok_r(ptr, ",", &save));
 	       ptr = NULL, g_count++) {
 	    if (max_groups <= g_count) {
 	      fprintf(stderr, "Too many groups specified (%d)\n", g_count);
@@ -663,12 +641,11 @@ int main(int argc, char *argv[], char *envp[])
 
 	    for (cap=0; (cap < 64) && (value >> cap); ++cap) {
 		if (value & (1ULL << cap)) {
-		    char *ptr;
+		    const char *ptr;
 
-		    ptr = cap_to_name(cap);
+		    ptr = cap_name_static(cap);
 		    if (ptr != NULL) {
 			printf("%s%s", sep, ptr);
-			cap_free(ptr);
 		    } else {
 			printf("%s%u", sep, cap);
 		    }
@@ -4,84 +4,1129 @@
  * This displays the capabilities of a given file.
  */
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
 #include <sys/capability.h>
+#include <linux/xattr.h>
 
 #include <ftw.h>
 
+#include "json.h"
+
 static int verbose = 0;
 static int recursive = 0;
 static int namespace = 0;
+static int sorted = 0;
+static unsigned jobs = 1;
+
+static enum {
+    FORMAT_TEXT,
+    FORMAT_NDJSON,
+    FORMAT_BIN,
+} format = FORMAT_TEXT;
 
 static void usage(void)
 {
     fprintf(stderr,
-	    "usage: getcap [-v] [-r] [-h] [-n] <filename> [<filename> ...]\n"
+	    "usage: getcap [-v] [-r] [-h] [-n] [-j <n>] [-s] [-i <index>]\n"
+	    "              [--format=(text|ndjson|bin)] <filename> [<filename> ...]\n"
 	    "\n"
 	    "\tdisplays the capabilities on the queried file(s).\n"
+	    "\t-j <n> uses n threads for a recursive (-r) search\n"
+	    "\t-s     sorts the output of a recursive search by filename\n"
+	    "\t-i <index> only queries files changed since the index was saved\n"
+	    "\t--format=ndjson writes a JSON object per file with capabilities\n"
+	    "\t--format=bin writes a binary record per file with capabilities\n"
 	);
     exit(1);
 }
 
-static int do_getcap(const char *fname, const struct stat *stbuf,
-		     int tflag, struct FTW* ftwbuf)
+/*
+ * Output is gathered in buffers of whole lines, or records. Each
+ * thread of a parallel search has its own; when the output is to be
+ * sorted the lines are kept until the search is over. The path of a
+ * line is found at its path offset.
+ */
+
+#define OUT_FLUSH_SIZE  (1 << 20)
+
+struct out_line_s {
+    size_t start, path, path_len;
+};
+
+struct out_s {
+    char *buf;
+    size_t len, size;
+    int keep;                    /* retain lines for sorting */
+    size_t flush_at;
+    struct out_line_s *lines;
+    size_t nlines, lines_size;
+};
+
+static struct out_s serial_out;
+
+static void *xrealloc(void *old, size_t size)
 {
-    cap_t cap_d;
-    char *result;
-    uid_t rootid;
+    void *ptr = realloc(old, size);
+    if (ptr == NULL) {
+	perror("getcap: out of memory");
+	exit(1);
+    }
+    return ptr;
+}
 
-    if (tflag != FTW_F) {
-	if (verbose) {
-	    printf("%s (Not a regular file)\n", fname);
+static char *xstrdup(const char *old)
+{
+    return strcpy(xrealloc(NULL, strlen(old) + 1), old);
+}
+
+static void out_flush(struct out_s *out)
+{
+    if (out->len) {
+	fwrite(out->buf, 1, out->len, stdout);
+	out->len = 0;
+    }
+}
+
+/*
+ * Make room for n more bytes of output.
+ */
+static char *out_reserve(struct out_s *out, size_t n)
+{
+    if (out->size - out->len < n) {
+	out->size = 2 * out->size + n + 256;
+	out->buf = xrealloc(out->buf, out->size);
+    }
+    return out->buf + out->len;
+}
+
+/*
+ * Complete the line, or record, that was appended from offset start.
+ */
+static void out_end(struct out_s *out, size_t start, size_t path,
+		    size_t path_len)
+{
+    if (out->keep) {
+	if (out->nlines == out->lines_size) {
+	    out->lines_size = 2 * out->lines_size + 64;
+	    out->lines = xrealloc(out->lines,
+				  out->lines_size * sizeof(*out->lines));
+	}
+	out->lines[out->nlines].start = start;
+	out->lines[out->nlines].path = path;
+	out->lines[out->nlines].path_len = path_len;
+	out->nlines++;
+    } else if (out->len >= out->flush_at) {
+	out_flush(out);
+    }
+}
+
+/*
+ * Append the line "<fname><suffix>\n", where suffix is formatted
+ * according to fmt.
+ */
+static void out_line(struct out_s *out, const char *fname,
+		     const char *fmt, ...)
+{
+    size_t start = out->len, path_len = strlen(fname);
+    va_list ap;
+    int n;
+
+    memcpy(out_reserve(out, path_len), fname, path_len);
+    out->len += path_len;
+    for (;;) {
+	size_t avail = out->size - out->len;
+
+	va_start(ap, fmt);
+	n = vsnprintf(out->buf + out->len, avail, fmt, ap);
+	va_end(ap);
+	if (n >= 0 && (size_t) n + 1 < avail) {
+	    break;
 	}
+	out_reserve(out, avail + (n > 0 ? n : 256));
+    }
+    out->len += n;
+    out->buf[out->len++] = '\n';
+
+    out_end(out, start, start, path_len);
+}
+
+/*
+ * Append {"path":"<fname>",...}\n for the capabilities of fname.
+ */
+static void out_json(struct out_s *out, const char *fname, uint64_t per,
+		     uint64_t inh, int effective, unsigned revision,
+		     uid_t rootid)
+{
+    size_t start = out->len, path, path_len = strlen(fname);
+    char *p;
+
+    p = out_reserve(out, JSON_ESCAPE_MAX * path_len + 160);
+    p += sprintf(p, "{\"path\":\"");
+    path = p - out->buf;
+    path_len = json_escape(p, fname);
+    p += path_len;
+    p += sprintf(p, "\",\"permitted\":\"0x%" PRIx64 "\",\"inheritable\":"
+		 "\"0x%" PRIx64 "\",\"effective\":%s,\"revision\":%u,"
+		 "\"rootid\":%u}\n", per, inh, effective ? "true" : "false",
+		 revision, (unsigned) rootid);
+    out->len = p - out->buf;
+
+    out_end(out, start, path, path_len);
+}
+
+static char *put_le(char *p, uint64_t value, unsigned bytes)
+{
+    while (bytes-- > 0) {
+	*p++ = value & 0xff;
+	value >>= 8;
+    }
+    return p;
+}
+
+/*
+ * Append a binary record for the capabilities of fname. All of the
+ * integers are little-endian:
+ *
+ *   u32 length          of what follows: BIN_HEADER_SIZE + path bytes
+ *   u8  version         BIN_VERSION
+ *   u8  revision        VFS revision of the xattr (1, 2 or 3)
+ *   u8  flags           BIN_EFFECTIVE
+ *   u8  reserved
+ *   u32 rootid
+ *   u64 permitted
+ *   u64 inheritable
+ *   the path, without a terminating NUL
+ */
+#define BIN_VERSION      1
+#define BIN_EFFECTIVE    1
+#define BIN_HEADER_SIZE  24
+
+static void out_bin(struct out_s *out, const char *fname, uint64_t per,
+		    uint64_t inh, int effective, unsigned revision,
+		    uid_t rootid)
+{
+    size_t start = out->len, path_len = strlen(fname);
+    char *p = out_reserve(out, 4 + BIN_HEADER_SIZE + path_len);
+
+    p = put_le(p, BIN_HEADER_SIZE + path_len, 4);
+    p = put_le(p, BIN_VERSION, 1);
+    p = put_le(p, revision, 1);
+    p = put_le(p, effective ? BIN_EFFECTIVE : 0, 1);
+    p = put_le(p, 0, 1);
+    p = put_le(p, rootid, 4);
+    p = put_le(p, per, 8);
+    p = put_le(p, inh, 8);
+    memcpy(p, fname, path_len);
+    out->len = p + path_len - out->buf;
+
+    out_end(out, start, p - out->buf, path_len);
+}
+
+/*
+ * The VFS revision of the capability xattr of a file, known from its
+ * size. This is only needed, and so only looked up, for the
+ * structured output formats. The file is identified by fd, or by path
+ * if fd < 0.
+ */
+static unsigned query_revision(cap_t cap_d, int fd, const char *path)
+{
+    ssize_t size;
+
+    if (cap_d == NULL || format == FORMAT_TEXT) {
+	return 0;
+    }
+    if (fd >= 0) {
+	size = fgetxattr(fd, XATTR_NAME_CAPS, NULL, 0);
+    } else {
+	size = getxattr(path, XATTR_NAME_CAPS, NULL, 0);
+    }
+    switch (size) {
+    case XATTR_CAPS_SZ_1:
+	return 1;
+    case XATTR_CAPS_SZ_2:
+	return 2;
+    case XATTR_CAPS_SZ_3:
+	return 3;
+    default:
 	return 0;
     }
+}
+
+/*
+ * Report the capabilities, cap_d, of fname. A NULL cap_d means they
+ * could not be obtained and errno says why. The structured formats
+ * only describe files with capabilities, and also need the VFS
+ * revision of these.
+ */
+static void report_caps(struct out_s *out, const char *fname, cap_t cap_d,
+			unsigned revision)
+{
+    char result[1024];
+    ssize_t length;
+    uid_t rootid;
 
-    cap_d = cap_get_file(fname);
     if (cap_d == NULL) {
 	if (errno != ENODATA) {
 	    fprintf(stderr, "Failed to get capabilities of file `%s' (%s)\n",
 		    fname, strerror(errno));
-	} else if (verbose) {
-	    printf("%s\n", fname);
+	} else if (verbose && format == FORMAT_TEXT) {
+	    out_line(out, fname, "");
 	}
-	return 0;
+	return;
     }
 
-    result = cap_to_text(cap_d, NULL);
-    if (!result) {
+    if (format != FORMAT_TEXT) {
+	uint64_t per = 0, inh = 0, eff = 0;
+
+	cap_get_mask(cap_d, CAP_PERMITTED, &per);
+	cap_get_mask(cap_d, CAP_INHERITABLE, &inh);
+	cap_get_mask(cap_d, CAP_EFFECTIVE, &eff);
+	rootid = cap_get_nsowner(cap_d);
+	if (format == FORMAT_NDJSON) {
+	    out_json(out, fname, per, inh, eff != 0, revision, rootid);
+	} else {
+	    out_bin(out, fname, per, inh, eff != 0, revision, rootid);
+	}
+	return;
+    }
+
+    length = cap_to_text_r(cap_d, result, sizeof(result));
+    if (length < 0 || length >= (ssize_t) sizeof(result)) {
 	fprintf(stderr,
 		"Failed to get capabilities of human readable format at `%s' (%s)\n",
 		fname, strerror(errno));
-	cap_free(cap_d);
-	return 0;
+	return;
     }
     rootid = cap_get_nsowner(cap_d);
     if (namespace && (rootid+1 > 1)) {
-	printf("%s %s [rootid=%d]\n", fname, result, rootid);
+	out_line(out, fname, " %s [rootid=%d]", result, rootid);
     } else {
-	printf("%s %s\n", fname, result);
+	out_line(out, fname, " %s", result);
+    }
+}
+
+/*
+ * The optional (-i) index of capabilities found by an earlier search.
+ * Entries are keyed by device and inode, and are only trusted if the
+ * file's ctime and size are unchanged: writing a capability xattr
+ * updates the ctime. A file found in the index is not queried again,
+ * which also means hard links are only queried once per search. The
+ * table is split into stripes, each with its own lock, so parallel
+ * workers rarely contend. When the search is complete, the index file
+ * is replaced with the entries for the files it visited, merged with
+ * the earlier entries for files outside the names searched. Each entry
+ * records the name the file was found by for this purpose. Files whose
+ * ctime is too close to the time the index is written are left out: a
+ * later change within the same timestamp tick would not be noticed.
+ */
+
+#define INDEX_MAGIC     "getcap index 3\n"
+#define INDEX_STRIPES   64
+#define INDEX_EXT_MAX   64
+#define INDEX_RACY_NS   2000000000LL   /* coarsest ctime granularity (FAT) */
+#define INDEX_PATH_MAX  65536
+
+#define INDEX_USED      1
+#define INDEX_SEEN      2
+#define INDEX_CAPS      4
+
+struct index_entry_s {
+    uint64_t dev, ino, size;
+    int64_t ctime_sec;
+    uint32_t ctime_nsec;
+    uint32_t rootid;
+    uint32_t path_len;           /* bytes of path after the record */
+    uint16_t flags;
+    uint16_t ext_len;
+    uint8_t revision;            /* 0 if it was not looked up */
+    uint8_t ext[INDEX_EXT_MAX];
+    char *path;                  /* not part of the record on disk */
+};
+
+#define INDEX_RECORD_SIZE offsetof(struct index_entry_s, path)
+
+struct index_header_s {
+    char magic[16];
+    uint32_t entry_size;
+    uint32_t reserved;
+    uint64_t count;
+};
+
+static const char *index_file = NULL;
+static char **index_roots;       /* the names searched */
+
+static struct index_stripe_s {
+    pthread_mutex_t mu;
+    struct index_entry_s *slots;
+    size_t count, size;
+} index_stripes[INDEX_STRIPES];
+
+static uint64_t index_hash(uint64_t dev, uint64_t ino)
+{
+    uint64_t h = (dev * 0x9e3779b97f4a7c15ULL) ^ ino;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/*
+ * Find the slot of (dev, ino) in a locked stripe, or the empty slot
+ * where it belongs.
+ */
+static struct index_entry_s *index_slot(struct index_stripe_s *stripe,
+					uint64_t h, uint64_t dev, uint64_t ino)
+{
+    size_t i;
+
+    for (i = (h / INDEX_STRIPES) & (stripe->size - 1); ;
+	 i = (i + 1) & (stripe->size - 1)) {
+	struct index_entry_s *e = &stripe->slots[i];
+
+	if (!(e->flags & INDEX_USED) || (e->dev == dev && e->ino == ino)) {
+	    return e;
+	}
+    }
+}
+
+/*
+ * Add, or overwrite, an entry. Called with the stripe locked.
+ */
+static void index_insert(const struct index_entry_s *entry)
+{
+    uint64_t h = index_hash(entry->dev, entry->ino);
+    struct index_stripe_s *stripe = &index_stripes[h % INDEX_STRIPES];
+    struct index_entry_s *e;
+
+    if (2 * (stripe->count + 1) > stripe->size) {
+	struct index_entry_s *old = stripe->slots;
+	size_t i, old_size = stripe->size;
+
+	stripe->size = old_size ? 2 * old_size : 64;
+	stripe->slots = xrealloc(NULL, stripe->size * sizeof(*old));
+	memset(stripe->slots, 0, stripe->size * sizeof(*old));
+	for (i = 0; i < old_size; i++) {
+	    if (old[i].flags & INDEX_USED) {
+		*index_slot(stripe, index_hash(old[i].dev, old[i].ino),
+			    old[i].dev, old[i].ino) = old[i];
+	    }
+	}
+	free(old);
+    }
+
+    e = index_slot(stripe, h, entry->dev, entry->ino);
+    if (!(e->flags & INDEX_USED)) {
+	stripe->count++;
+    } else if (e->path != entry->path) {
+	free(e->path);
+    }
+    *e = *entry;
+}
+
+static void index_load(void)
+{
+    struct index_header_s header;
+    struct index_entry_s entry;
+    unsigned i;
+    uint64_t n;
+    FILE *f;
+
+    for (i = 0; i < INDEX_STRIPES; i++) {
+	pthread_mutex_init(&index_stripes[i].mu, NULL);
+    }
+
+    f = fopen(index_file, "r");
+    if (f == NULL) {
+	if (errno != ENOENT) {
+	    fprintf(stderr, "%s (%s)\n", index_file, strerror(errno));
+	}
+	return;
+    }
+
+    if (fread(&header, sizeof(header), 1, f) != 1
+	|| memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic))
+	|| header.entry_size != INDEX_RECORD_SIZE) {
+	fprintf(stderr, "%s: not a usable index, rebuilding it\n",
+		index_file);
+	fclose(f);
+	return;
+    }
+
+    for (n = 0; n < header.count && fread(&entry, INDEX_RECORD_SIZE, 1, f);
+	 n++) {
+	if (entry.ext_len > INDEX_EXT_MAX || entry.path_len >= INDEX_PATH_MAX) {
+	    break;
+	}
+	entry.path = xrealloc(NULL, entry.path_len + 1);
+	if (fread(entry.path, 1, entry.path_len, f) != entry.path_len) {
+	    free(entry.path);
+	    break;
+	}
+	entry.path[entry.path_len] = '\0';
+	entry.flags = (entry.flags & INDEX_CAPS) | INDEX_USED;
+	index_insert(&entry);
+    }
+    fclose(f);
+}
+
+/*
+ * Was path one of the names searched, or, for a recursive search, in
+ * the tree below one of them?
+ */
+static int index_searched(const char *path)
+{
+    char **root;
+
+    for (root = index_roots; *root != NULL; root++) {
+	size_t n = strlen(*root);
+
+	if (strncmp(path, *root, n)) {
+	    continue;
+	}
+	if (path[n] == '\0' || (recursive && n > 0
+				&& (path[n] == '/' || (*root)[n-1] == '/'))) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Should an entry be written to an index saved at cutoff (in ns, less
+ * the racy window)? An earlier entry the search did not see is only
+ * kept if the search did not look where it was found: otherwise the
+ * file has gone.
+ */
+static int index_keep(const struct index_entry_s *e, int64_t cutoff)
+{
+    if (!(e->flags & INDEX_USED)) {
+	return 0;
+    }
+    if (!(e->flags & INDEX_SEEN)) {
+	return !index_searched(e->path);
+    }
+    return e->ctime_sec * 1000000000LL + e->ctime_nsec < cutoff;
+}
+
+/*
+ * Write out the entries seen by this search, and the earlier ones it
+ * could not have seen, atomically replacing the index file.
+ */
+static void index_save(void)
+{
+    struct index_header_s header;
+    size_t len = strlen(index_file);
+    char *tmp = xrealloc(NULL, len + 32);
+    struct timespec now;
+    int64_t cutoff;
+    unsigned i;
+    FILE *f;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    cutoff = now.tv_sec * 1000000000LL + now.tv_nsec - INDEX_RACY_NS;
+
+    snprintf(tmp, len + 32, "%s.tmp.%ld", index_file, (long) getpid());
+    f = fopen(tmp, "w");
+    if (f == NULL) {
+	fprintf(stderr, "%s (%s)\n", tmp, strerror(errno));
+	free(tmp);
+	return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.entry_size = INDEX_RECORD_SIZE;
+    for (i = 0; i < INDEX_STRIPES; i++) {
+	size_t j;
+
+	for (j = 0; j < index_stripes[i].size; j++) {
+	    header.count += index_keep(&index_stripes[i].slots[j], cutoff);
+	}
+    }
+    fwrite(&header, sizeof(header), 1, f);
+
+    for (i = 0; i < INDEX_STRIPES; i++) {
+	size_t j;
+
+	for (j = 0; j < index_stripes[i].size; j++) {
+	    const struct index_entry_s *e = &index_stripes[i].slots[j];
+
+	    if (index_keep(e, cutoff)) {
+		fwrite(e, INDEX_RECORD_SIZE, 1, f);
+		fwrite(e->path, 1, e->path_len, f);
+	    }
+	}
+    }
+
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0 || ferror(f)) {
+	fprintf(stderr, "%s (%s)\n", tmp, strerror(errno));
+	fclose(f);
+	unlink(tmp);
+    } else if (fclose(f) != 0 || rename(tmp, index_file) != 0) {
+	fprintf(stderr, "%s (%s)\n", index_file, strerror(errno));
+	unlink(tmp);
+    }
+    free(tmp);
+}
+
+/*
+ * Look for a current entry for the file st describes. On a hit, *cap_p
+ * is set to its capabilities, decoded into storage, or to NULL with
+ * errno set to ENODATA if it has none, *revision_p to the revision of
+ * these, and 1 is returned.
+ */
+static int index_get(const struct stat *st, cap_storage_t *storage,
+		     cap_t *cap_p, unsigned *revision_p)
+{
+    uint64_t h;
+    struct index_stripe_s *stripe;
+    struct index_entry_s *e;
+    int hit = 0;
+
+    if (index_file == NULL || st == NULL) {
+	return 0;
+    }
+
+    h = index_hash(st->st_dev, st->st_ino);
+    stripe = &index_stripes[h % INDEX_STRIPES];
+
+    pthread_mutex_lock(&stripe->mu);
+    if (stripe->size == 0) {
+	goto done;
     }
+    e = index_slot(stripe, h, st->st_dev, st->st_ino);
+    if ((e->flags & INDEX_USED) && e->size == (uint64_t) st->st_size
+	&& e->ctime_sec == st->st_ctim.tv_sec
+	&& e->ctime_nsec == (uint32_t) st->st_ctim.tv_nsec) {
+	e->flags |= INDEX_SEEN;
+	hit = 1;
+	*revision_p = e->revision;
+	if (e->flags & INDEX_CAPS) {
+	    if (format != FORMAT_TEXT && e->revision == 0) {
+		/* query it again to learn the revision */
+		hit = 0;
+		goto done;
+	    }
+	    *cap_p = cap_init_storage(storage);
+	    if (cap_copy_int_into(*cap_p, e->ext) != 0
+		|| cap_set_nsowner(*cap_p, e->rootid) != 0) {
+		hit = 0;
+	    }
+	} else {
+	    *cap_p = NULL;
+	    errno = ENODATA;
+	}
+    }
+done:
+    pthread_mutex_unlock(&stripe->mu);
+
+    return hit;
+}
+
+/*
+ * Record what a query of the file st describes, found by path, found.
+ * Transient failures are not recorded. errno is preserved.
+ */
+static void index_put(const struct stat *st, const char *path,
+		      cap_t cap_d, unsigned revision)
+{
+    struct index_entry_s entry;
+    struct index_stripe_s *stripe;
+    int err = errno;
+
+    if (index_file == NULL || st == NULL
+	|| (cap_d == NULL && err != ENODATA)
+	|| strlen(path) >= INDEX_PATH_MAX) {
+	return;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.dev = st->st_dev;
+    entry.ino = st->st_ino;
+    entry.size = st->st_size;
+    entry.ctime_sec = st->st_ctim.tv_sec;
+    entry.ctime_nsec = st->st_ctim.tv_nsec;
+    entry.flags = INDEX_USED | INDEX_SEEN;
+    if (cap_d != NULL) {
+	ssize_t len = cap_copy_ext(entry.ext, cap_d, sizeof(entry.ext));
+
+	if (len <= 0) {
+	    errno = err;
+	    return;
+	}
+	entry.ext_len = len;
+	entry.rootid = cap_get_nsowner(cap_d);
+	entry.revision = revision;
+	entry.flags |= INDEX_CAPS;
+    }
+    entry.path_len = strlen(path);
+    entry.path = xstrdup(path);
+
+    stripe = &index_stripes[index_hash(entry.dev, entry.ino) % INDEX_STRIPES];
+    pthread_mutex_lock(&stripe->mu);
+    index_insert(&entry);
+    pthread_mutex_unlock(&stripe->mu);
+
+    errno = err;
+}
+
+static int do_getcap(const char *fname, const struct stat *stbuf,
+		     int tflag, struct FTW* ftwbuf)
+{
+    cap_storage_t storage;
+    unsigned revision;
+    cap_t cap_d;
+
+    if (tflag != FTW_F) {
+	if (verbose && format == FORMAT_TEXT) {
+	    out_line(&serial_out, fname, " (Not a regular file)");
+	}
+	return 0;
+    }
+
+    if (!index_get(stbuf, &storage, &cap_d, &revision)) {
+	cap_d = cap_get_file(fname);
+	revision = query_revision(cap_d, -1, fname);
+	index_put(stbuf, fname, cap_d, revision);
+    }
+    report_caps(&serial_out, fname, cap_d, revision);
     cap_free(cap_d);
-    cap_free(result);
 
     return 0;
 }
 
+/*
+ * The parallel (-j) recursive search. Each worker owns a deque of
+ * directories still to be read. It pushes the subdirectories it finds
+ * onto the bottom of its own deque and takes work from there, so it
+ * proceeds depth first; idle workers steal from the top of other
+ * workers' deques, where the largest unexplored subtrees are. Every
+ * worker holds at most one directory and one file open at a time.
+ */
+
+#define WALK_DENTS_SIZE  32768
+#define WALK_FDS_PER_JOB 2
+#define WALK_FDS_RESERVE 16   /* stdio, the index and libc's own */
+
+struct walk_dirent64_s {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct walk_worker_s {
+    pthread_t thread;
+    unsigned id;
+    pthread_mutex_t mu;          /* protects the deque */
+    char **deque;
+    size_t top, bottom, size;    /* pending are deque[top..bottom) */
+    char *dents;
+    struct out_s out;
+};
+
+static struct {
+    struct walk_worker_s *workers;
+    long pending;                /* directories queued or being read */
+    unsigned long seq;           /* bumped whenever work appears */
+    int idle;
+    pthread_mutex_t idle_mu;
+    pthread_cond_t idle_cv;
+} walk = {
+    .idle_mu = PTHREAD_MUTEX_INITIALIZER,
+    .idle_cv = PTHREAD_COND_INITIALIZER,
+};
+
+static void walk_wake(int all)
+{
+    __atomic_add_fetch(&walk.seq, 1, __ATOMIC_SEQ_CST);
+    if (all || __atomic_load_n(&walk.idle, __ATOMIC_SEQ_CST)) {
+	pthread_mutex_lock(&walk.idle_mu);
+	if (all) {
+	    pthread_cond_broadcast(&walk.idle_cv);
+	} else {
+	    pthread_cond_signal(&walk.idle_cv);
+	}
+	pthread_mutex_unlock(&walk.idle_mu);
+    }
+}
+
+static void walk_push(struct walk_worker_s *w, char *path)
+{
+    __atomic_add_fetch(&walk.pending, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&w->mu);
+    if (w->bottom == w->size) {
+	if (w->top > 0) {
+	    memmove(w->deque, w->deque + w->top,
+		    (w->bottom - w->top) * sizeof(char *));
+	    w->bottom -= w->top;
+	    w->top = 0;
+	} else {
+	    w->size = 2 * w->size + 64;
+	    w->deque = xrealloc(w->deque, w->size * sizeof(char *));
+	}
+    }
+    w->deque[w->bottom++] = path;
+    pthread_mutex_unlock(&w->mu);
+
+    walk_wake(0);
+}
+
+static char *walk_pop(struct walk_worker_s *w)
+{
+    char *path = NULL;
+
+    pthread_mutex_lock(&w->mu);
+    if (w->bottom > w->top) {
+	path = w->deque[--w->bottom];
+    }
+    pthread_mutex_unlock(&w->mu);
+
+    return path;
+}
+
+static char *walk_steal(struct walk_worker_s *self)
+{
+    unsigned i;
+
+    for (i = 1; i < jobs; i++) {
+	struct walk_worker_s *victim = &walk.workers[(self->id + i) % jobs];
+	char *path = NULL;
+
+	pthread_mutex_lock(&victim->mu);
+	if (victim->bottom > victim->top) {
+	    path = victim->deque[victim->top++];
+	}
+	pthread_mutex_unlock(&victim->mu);
+
+	if (path != NULL) {
+	    return path;
+	}
+    }
+    return NULL;
+}
+
+static char *walk_join(const char *dir, const char *name)
+{
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    char *path = xrealloc(NULL, dlen + nlen + 2);
+
+    memcpy(path, dir, dlen);
+    if (dlen == 0 || dir[dlen-1] != '/') {
+	path[dlen++] = '/';
+    }
+    memcpy(path + dlen, name, nlen + 1);
+
+    return path;
+}
+
+/*
+ * Query a file relative to its directory. Where a regular file cannot
+ * be opened for reading, and for special files, which (as with nftw())
+ * are queried but never opened, fall back to a lookup by path.
+ */
+static void walk_file(struct walk_worker_s *w, int dfd, const char *name,
+		      const char *path, int regular)
+{
+    cap_storage_t storage;
+    struct stat st, *stp = NULL;
+    unsigned revision = 0;
+    cap_t cap_d;
+    int fd;
+
+    if (index_file != NULL
+	&& fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+	stp = &st;
+	if (index_get(stp, &storage, &cap_d, &revision)) {
+	    goto report;
+	}
+    }
+
+    fd = -1;
+    if (regular) {
+	fd = openat(dfd, name,
+		    O_RDONLY|O_NOFOLLOW|O_NONBLOCK|O_NOCTTY|O_CLOEXEC);
+    }
+    if (fd >= 0) {
+	int err;
+
+	cap_d = cap_get_fd(fd);
+	err = errno;
+	revision = query_revision(cap_d, fd, NULL);
+	close(fd);
+	errno = err;
+    } else if (!regular || errno == EACCES || errno == EPERM) {
+	cap_d = cap_get_file(path);
+	revision = query_revision(cap_d, -1, path);
+    } else {
+	cap_d = NULL;
+    }
+    index_put(stp, path, cap_d, revision);
+
+report:
+    report_caps(&w->out, path, cap_d, revision);
+    cap_free(cap_d);
+}
+
+static void walk_dir(struct walk_worker_s *w, const char *path)
+{
+    int dfd;
+
+    if (verbose && format == FORMAT_TEXT) {
+	out_line(&w->out, path, " (Not a regular file)");
+    }
+
+    dfd = open(path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if (dfd < 0) {
+	fprintf(stderr, "%s (%s)\n", path, strerror(errno));
+	return;
+    }
+
+    for (;;) {
+	long n, off;
+
+	n = syscall(SYS_getdents64, dfd, w->dents, WALK_DENTS_SIZE);
+	if (n <= 0) {
+	    if (n < 0) {
+		fprintf(stderr, "%s (%s)\n", path, strerror(errno));
+	    }
+	    break;
+	}
+
+	for (off = 0; off < n; ) {
+	    struct walk_dirent64_s *d =
+		(struct walk_dirent64_s *) (w->dents + off);
+	    unsigned char type = d->d_type;
+	    char *child;
+
+	    off += d->d_reclen;
+	    if (d->d_name[0] == '.' && (d->d_name[1] == '\0'
+		|| (d->d_name[1] == '.' && d->d_name[2] == '\0'))) {
+		continue;
+	    }
+
+	    if (type == DT_UNKNOWN) {
+		struct stat st;
+
+		type = DT_LNK;        /* ie., not something to look at */
+		if (fstatat(dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+		    if (S_ISDIR(st.st_mode)) {
+			type = DT_DIR;
+		    } else if (S_ISREG(st.st_mode)) {
+			type = DT_REG;
+		    } else if (!S_ISLNK(st.st_mode)) {
+			type = DT_FIFO;
+		    }
+		}
+	    }
+
+	    child = walk_join(path, d->d_name);
+	    switch (type) {
+	    case DT_DIR:
+		walk_push(w, child);
+		continue;
+	    case DT_REG:
+		walk_file(w, dfd, d->d_name, child, 1);
+		break;
+	    case DT_LNK:
+		if (verbose && format == FORMAT_TEXT) {
+		    out_line(&w->out, child, " (Not a regular file)");
+		}
+		break;
+	    default:
+		walk_file(w, dfd, d->d_name, child, 0);
+		break;
+	    }
+	    free(child);
+	}
+    }
+
+    close(dfd);
+}
+
+static void *walk_worker(void *arg)
+{
+    struct walk_worker_s *w = arg;
+
+    for (;;) {
+	unsigned long seq = __atomic_load_n(&walk.seq, __ATOMIC_SEQ_CST);
+	char *path;
+
+	path = walk_pop(w);
+	if (path == NULL) {
+	    path = walk_steal(w);
+	}
+	if (path != NULL) {
+	    walk_dir(w, path);
+	    free(path);
+	    if (__atomic_sub_fetch(&walk.pending, 1, __ATOMIC_SEQ_CST) == 0) {
+		walk_wake(1);
+	    }
+	    continue;
+	}
+
+	if (__atomic_load_n(&walk.pending, __ATOMIC_SEQ_CST) == 0) {
+	    break;
+	}
+
+	pthread_mutex_lock(&walk.idle_mu);
+	__atomic_add_fetch(&walk.idle, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&walk.seq, __ATOMIC_SEQ_CST) == seq
+	       && __atomic_load_n(&walk.pending, __ATOMIC_SEQ_CST) != 0) {
+	    pthread_cond_wait(&walk.idle_cv, &walk.idle_mu);
+	}
+	__atomic_sub_fetch(&walk.idle, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&walk.idle_mu);
+    }
+
+    if (!w->out.keep) {
+	flockfile(stdout);
+	out_flush(&w->out);
+	funlockfile(stdout);
+    }
+    return NULL;
+}
+
+static void walk_init(void)
+{
+    struct rlimit rl;
+    unsigned i;
+
+    /* more workers than open files allow would only fail with EMFILE */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+	rlim_t fit = 1;
+
+	if (rl.rlim_cur > WALK_FDS_RESERVE + WALK_FDS_PER_JOB) {
+	    fit = (rl.rlim_cur - WALK_FDS_RESERVE) / WALK_FDS_PER_JOB;
+	}
+	if (jobs > fit) {
+	    jobs = fit;
+	}
+    }
+
+    walk.workers = xrealloc(NULL, jobs * sizeof(*walk.workers));
+    memset(walk.workers, 0, jobs * sizeof(*walk.workers));
+    for (i = 0; i < jobs; i++) {
+	struct walk_worker_s *w = &walk.workers[i];
+
+	w->id = i;
+	pthread_mutex_init(&w->mu, NULL);
+	w->dents = xrealloc(NULL, WALK_DENTS_SIZE);
+	w->out.keep = sorted;
+	w->out.flush_at = OUT_FLUSH_SIZE;
+    }
+}
+
+struct sorted_line_s {
+    const char *text, *path;
+    size_t path_len, len;
+};
+
+static int walk_cmp(const void *a, const void *b)
+{
+    const struct sorted_line_s *x = a, *y = b;
+    size_t n = x->path_len < y->path_len ? x->path_len : y->path_len;
+    int c;
+
+    c = memcmp(x->path, y->path, n);
+    if (c == 0 && x->path_len != y->path_len) {
+	c = x->path_len < y->path_len ? -1 : 1;
+    }
+    return c;
+}
+
+/*
+ * Print the lines gathered by all of the workers, ordered by filename.
+ */
+static void walk_sorted_output(void)
+{
+    struct sorted_line_s *all;
+    size_t total = 0, k = 0;
+    unsigned i;
+
+    for (i = 0; i < jobs; i++) {
+	total += walk.workers[i].out.nlines;
+    }
+    all = xrealloc(NULL, (total + 1) * sizeof(*all));
+
+    for (i = 0; i < jobs; i++) {
+	struct out_s *out = &walk.workers[i].out;
+	size_t j;
+
+	for (j = 0; j < out->nlines; j++) {
+	    size_t start = out->lines[j].start;
+	    size_t end = (j + 1 < out->nlines) ? out->lines[j+1].start
+		: out->len;
+
+	    all[k].text = out->buf + start;
+	    all[k].path = out->buf + out->lines[j].path;
+	    all[k].path_len = out->lines[j].path_len;
+	    all[k].len = end - start;
+	    k++;
+	}
+    }
+
+    qsort(all, total, sizeof(*all), walk_cmp);
+    for (k = 0; k < total; k++) {
+	fwrite(all[k].text, 1, all[k].len, stdout);
+    }
+    free(all);
+}
+
+static void walk_run(void)
+{
+    unsigned i;
+
+    for (i = 0; i < jobs; i++) {
+	if (pthread_create(&walk.workers[i].thread, NULL, walk_worker,
+			   &walk.workers[i]) != 0) {
+	    perror("getcap: unable to start thread");
+	    exit(1);
+	}
+    }
+    for (i = 0; i < jobs; i++) {
+	pthread_join(walk.workers[i].thread, NULL);
+    }
+
+    if (sorted) {
+	walk_sorted_output();
+    }
+}
+
 int main(int argc, char **argv)
 {
-    int i, c;
+    static const struct option long_options[] = {
+	{"format", required_argument, NULL, 'F'},
+	{NULL, 0, NULL, 0},
+    };
+    int i, c, parallel;
+    char *end;
 
-    while ((c = getopt(argc, argv, "rvhn")) > 0) {
+    while ((c = getopt_long(argc, argv, "rvhnj:si:", long_options,
+			    NULL)) > 0) {
 	switch(c) {
 	case 'r':
 	    recursive = 1;
@@ -92,6 +1137,29 @@ int main(int argc, char **argv)
 	case 'n':
 	    namespace = 1;
 	    break;
+	case 'j':
+	    jobs = strtoul(optarg, &end, 0);
+	    if (*end || jobs < 1 || jobs > 1024) {
+		usage();
+	    }
+	    break;
+	case 's':
+	    sorted = 1;
+	    break;
+	case 'i':
+	    index_file = optarg;
+	    break;
+	case 'F':
+	    if (!strcmp(optarg, "text")) {
+		format = FORMAT_TEXT;
+	    } else if (!strcmp(optarg, "ndjson")) {
+		format = FORMAT_NDJSON;
+	    } else if (!strcmp(optarg, "bin")) {
+		format = FORMAT_BIN;
+	    } else {
+		usage();
+	    }
+	    break;
 	default:
 	    usage();
 	}
@@ -100,11 +1168,41 @@ int main(int argc, char **argv)
     if (!argv[optind])
 	usage();
 
+    if (index_file != NULL) {
+	index_roots = &argv[optind];
+	index_load();
+    }
+
+    /* text output is interleaved with errors, so it is not held back */
+    serial_out.flush_at = format == FORMAT_TEXT ? 1 : OUT_FLUSH_SIZE;
+    parallel = recursive && (jobs > 1 || sorted);
+    if (parallel) {
+	walk_init();
+    }
+
     for (i=optind; argv[i] != NULL; i++) {
 	struct stat stbuf;
 
 	if (lstat(argv[i], &stbuf) != 0) {
 	    fprintf(stderr, "%s (%s)\n", argv[i], strerror(errno));
+	} else if (parallel) {
+	    if (S_ISDIR(stbuf.st_mode)) {
+		walk_push(&walk.workers[0], xstrdup(argv[i]));
+	    } else if (S_ISREG(stbuf.st_mode)) {
+		cap_storage_t storage;
+		unsigned revision;
+		cap_t cap_d;
+
+		if (!index_get(&stbuf, &storage, &cap_d, &revision)) {
+		    cap_d = cap_get_file(argv[i]);
+		    revision = query_revision(cap_d, -1, argv[i]);
+		    index_put(&stbuf, argv[i], cap_d, revision);
+		}
+		report_caps(&walk.workers[0].out, argv[i], cap_d, revision);
+		cap_free(cap_d);
+	    } else if (verbose && format == FORMAT_TEXT) {
+		out_line(&walk.workers[0].out, argv[i], " (Not a regular file)");
+	    }
 	} else if (recursive) {
 	    nftw(argv[i], do_getcap, 20, FTW_PHYS);
 	} else {
@@ -114,5 +1212,13 @@ int main(int argc, char **argv)
 	}
     }
 
+    if (parallel) {
+	walk_run();
+    }
+    out_flush(&serial_out);
+    if (index_file != NULL) {
+	index_save();
+    }
+
     return 0;
 }
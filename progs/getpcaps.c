@@ -5,23 +5,300 @@
  */
 
 #include <sys/types.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/capability.h>
 
+#include "json.h"
+
 static void usage(void)
 {
     fprintf(stderr,
-"usage: getcaps <pid> [<pid> ...]\n\n"
+"usage: getpcaps <pid> [<pid> ...]\n"
+"       getpcaps --all\n\n"
 "  This program displays the capabilities on the queried process(es).\n"
-"  The capabilities are displayed in the cap_from_text(3) format.\n\n"
+"  The capabilities are displayed in the cap_from_text(3) format.\n"
+"  With --all, every thread is described by a JSON object per line.\n\n"
 "[Copyright (c) 1997-8,2007 Andrew G. Morgan  <morgan@kernel.org>]\n"
 	);
     exit(1);
 }
 
+/*
+ * --all reads the capabilities of every process from a single read of
+ * its /proc/<pid>/status file. Most processes share a handful of
+ * capability states, so each distinct state is interned: it is
+ * described by a "set" record, with its cap_to_text() form, the first
+ * time it is seen, and process records refer to it by number.
+ */
+
+struct proc_caps_s {
+    uint64_t inh, per, eff, bnd, amb;
+};
+
+struct intern_s {
+    struct proc_caps_s caps;
+    unsigned id;                 /* 0 for an unused slot */
+};
+
+static struct {
+    struct intern_s *slots;
+    size_t count, size;
+} interned;
+
+static void *xrealloc(void *old, size_t size)
+{
+    void *ptr = realloc(old, size);
+    if (ptr == NULL) {
+	perror("getpcaps: out of memory");
+	exit(1);
+    }
+    return ptr;
+}
+
+static size_t intern_hash(const struct proc_caps_s *caps)
+{
+    uint64_t h = caps->inh;
+
+    h = (h ^ caps->per) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ caps->eff) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ caps->bnd) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ caps->amb) * 0x9e3779b97f4a7c15ULL;
+    return h ^ (h >> 29);
+}
+
+static struct intern_s *intern_slot(const struct proc_caps_s *caps)
+{
+    size_t i;
+
+    for (i = intern_hash(caps) & (interned.size - 1); ;
+	 i = (i + 1) & (interned.size - 1)) {
+	struct intern_s *e = &interned.slots[i];
+
+	if (e->id == 0 || !memcmp(&e->caps, caps, sizeof(*caps))) {
+	    return e;
+	}
+    }
+}
+
+/*
+ * Return the number of the interned copy of caps, printing a "set"
+ * record when it is new.
+ */
+static unsigned intern(const struct proc_caps_s *caps)
+{
+    struct intern_s *e;
+    cap_t cap_d;
+    char *text;
+
+    if (2 * (interned.count + 1) > interned.size) {
+	struct intern_s *old = interned.slots;
+	size_t i, old_size = interned.size;
+
+	interned.size = old_size ? 2 * old_size : 64;
+	interned.slots = xrealloc(NULL, interned.size * sizeof(*old));
+	memset(interned.slots, 0, interned.size * sizeof(*old));
+	for (i = 0; i < old_size; i++) {
+	    if (old[i].id) {
+		*intern_slot(&old[i].caps) = old[i];
+	    }
+	}
+	free(old);
+    }
+
+    e = intern_slot(caps);
+    if (e->id) {
+	return e->id;
+    }
+    e->caps = *caps;
+    e->id = ++interned.count;
+
+    cap_d = cap_init();
+    if (cap_d == NULL
+	|| cap_set_mask(cap_d, CAP_INHERITABLE, caps->inh)
+	|| cap_set_mask(cap_d, CAP_PERMITTED, caps->per)
+	|| cap_set_mask(cap_d, CAP_EFFECTIVE, caps->eff)
+	|| (text = cap_to_text(cap_d, NULL)) == NULL) {
+	perror("getpcaps: unable to describe capabilities");
+	exit(1);
+    }
+    printf("{\"set\":%u,\"text\":", e->id);
+    json_string(stdout, text);
+    printf(",\"inheritable\":\"0x%" PRIx64 "\",\"permitted\":\"0x%" PRIx64
+	   "\",\"effective\":\"0x%" PRIx64 "\",\"bounding\":\"0x%" PRIx64
+	   "\",\"ambient\":\"0x%" PRIx64 "\"}\n", caps->inh, caps->per,
+	   caps->eff, caps->bnd, caps->amb);
+    cap_free(text);
+    cap_free(cap_d);
+
+    return e->id;
+}
+
+static const char *parse_hex(const char *p, uint64_t *value)
+{
+    uint64_t v = 0;
+
+    for (;; p++) {
+	unsigned d = (unsigned char) *p - '0';
+
+	if (d > 9) {
+	    d = ((unsigned char) *p | 0x20) - 'a';
+	    if (d > 5) {
+		break;
+	    }
+	    d += 10;
+	}
+	v = (v << 4) | d;
+    }
+    *value = v;
+    return p;
+}
+
+/*
+ * Extract the Name, Uid and Cap* fields of a status file. Returns the
+ * number of Cap* fields found.
+ */
+static int parse_status(char *text, const char **name, unsigned long *uid,
+			struct proc_caps_s *caps)
+{
+    static const struct {
+	const char *prefix;
+	size_t offset;
+    } fields[] = {
+	{ "CapInh:", offsetof(struct proc_caps_s, inh) },
+	{ "CapPrm:", offsetof(struct proc_caps_s, per) },
+	{ "CapEff:", offsetof(struct proc_caps_s, eff) },
+	{ "CapBnd:", offsetof(struct proc_caps_s, bnd) },
+	{ "CapAmb:", offsetof(struct proc_caps_s, amb) },
+    };
+    int found = 0;
+    char *line, *next;
+    unsigned i;
+
+    for (line = text; *line; line = next) {
+	next = strchr(line, '\n');
+	if (next == NULL) {
+	    next = line + strlen(line);
+	} else {
+	    *next++ = '\0';
+	}
+
+	if (!strncmp(line, "Cap", 3)) {
+	    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		if (!strncmp(line, fields[i].prefix, 7)) {
+		    const char *p = line + 7;
+
+		    p += strspn(p, " \t");
+		    parse_hex(p, (uint64_t *) ((char *) caps + fields[i].offset));
+		    found++;
+		    break;
+		}
+	    }
+	} else if (!strncmp(line, "Name:\t", 6)) {
+	    *name = line + 6;
+	} else if (!strncmp(line, "Uid:\t", 5)) {
+	    *uid = strtoul(line + 5, NULL, 10);
+	}
+    }
+    return found;
+}
+
+/*
+ * Describe one thread of process pid, whose status file is path
+ * relative to dfd.
+ */
+static void do_task(int dfd, const char *path, const char *pid,
+		    const char *tid)
+{
+    char buffer[8192];
+    struct proc_caps_s caps;
+    unsigned long uid = 0;
+    const char *name = "";
+    unsigned set;
+    ssize_t n;
+    int fd;
+
+    fd = openat(dfd, path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0) {
+	return;                     /* it has probably exited */
+    }
+    n = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (n <= 0) {
+	return;
+    }
+    buffer[n] = '\0';
+
+    memset(&caps, 0, sizeof(caps));
+    if (parse_status(buffer, &name, &uid, &caps) == 0) {
+	return;
+    }
+    set = intern(&caps);
+    printf("{\"pid\":%s,\"tid\":%s,\"name\":", pid, tid);
+    json_string(stdout, name);
+    printf(",\"uid\":%lu,\"set\":%u}\n", uid, set);
+}
+
+/*
+ * Capabilities are a property of each thread, and the threads of a
+ * process need not agree, so every thread in /proc/<pid>/task is
+ * described.
+ */
+static int do_all(void)
+{
+    struct dirent *d;
+    DIR *proc;
+
+    proc = opendir("/proc");
+    if (proc == NULL) {
+	perror("getpcaps: unable to read /proc");
+	return 1;
+    }
+
+    while ((d = readdir(proc)) != NULL) {
+	char path[sizeof(d->d_name) + 8];
+	struct dirent *t;
+	DIR *tasks;
+	int fd;
+
+	if (d->d_name[0] < '1' || d->d_name[0] > '9') {
+	    continue;
+	}
+	snprintf(path, sizeof(path), "%s/task", d->d_name);
+	fd = openat(dirfd(proc), path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd < 0 || (tasks = fdopendir(fd)) == NULL) {
+	    if (fd >= 0) {
+		close(fd);
+	    }
+	    snprintf(path, sizeof(path), "%s/status", d->d_name);
+	    do_task(dirfd(proc), path, d->d_name, d->d_name);
+	    continue;
+	}
+	while ((t = readdir(tasks)) != NULL) {
+	    char status[sizeof(t->d_name) + 8];
+
+	    if (t->d_name[0] < '1' || t->d_name[0] > '9') {
+		continue;
+	    }
+	    snprintf(status, sizeof(status), "%s/status", t->d_name);
+	    do_task(dirfd(tasks), status, d->d_name, t->d_name);
+	}
+	closedir(tasks);
+    }
+    closedir(proc);
+    free(interned.slots);
+
+    return fflush(stdout) != 0;
+}
+
 int main(int argc, char **argv)
 {
     int retval = 0;
@@ -30,6 +307,13 @@ int main(int argc, char **argv)
 	usage();
     }
 
+    if (!strcmp(argv[1], "--all")) {
+	if (argc != 2) {
+	    usage();
+	}
+	exit(do_all());
+    }
+
     for ( ++argv; --argc > 0; ++argv ) {
 	ssize_t length;
 	int pid;
@@ -0,0 +1,123 @@
+/*
+ * JSON string escaping shared by getcap, setcap and getpcaps.
+ *
+ * File names are bytes, not text, and need not be valid UTF-8. Bytes
+ * that are not part of a well formed UTF-8 sequence are written as
+ * the lone surrogates \udc80..\udcff, which is how Python's
+ * "surrogateescape" error handler represents them, so the original
+ * name can be recovered. Everything else is copied through, apart
+ * from the escapes JSON requires.
+ */
+
+#include <string.h>
+
+#include "json.h"
+
+/*
+ * Return the length of the well formed UTF-8 sequence at s, or 0.
+ * Overlong forms, surrogates and values beyond U+10FFFF are not well
+ * formed.
+ */
+static size_t utf8_len(const unsigned char *s)
+{
+    unsigned char lo = 0x80, hi = 0xbf;
+    size_t i, n;
+
+    if (s[0] < 0x80) {
+	return 1;
+    } else if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+	n = 2;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+	n = 3;
+	if (s[0] == 0xe0) {
+	    lo = 0xa0;
+	} else if (s[0] == 0xed) {
+	    hi = 0x9f;
+	}
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+	n = 4;
+	if (s[0] == 0xf0) {
+	    lo = 0x90;
+	} else if (s[0] == 0xf4) {
+	    hi = 0x8f;
+	}
+    } else {
+	return 0;
+    }
+
+    if (s[1] < lo || s[1] > hi) {
+	return 0;
+    }
+    for (i = 2; i < n; i++) {
+	if ((s[i] & 0xc0) != 0x80) {
+	    return 0;
+	}
+    }
+    return n;
+}
+
+/*
+ * Escape the character at *src into dst, advancing *src past it.
+ * Returns the number of bytes written, at most JSON_ESCAPE_MAX.
+ */
+static size_t json_escape_char(char *dst, const char **src)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *s = (const unsigned char *) *src;
+    size_t n = utf8_len(s);
+
+    if (n == 0) {
+	memcpy(dst, "\\udc", 4);
+	dst[4] = hex[s[0] >> 4];
+	dst[5] = hex[s[0] & 15];
+	*src += 1;
+	return 6;
+    }
+    *src += n;
+    if (n > 1) {
+	memcpy(dst, s, n);
+	return n;
+    }
+    if (s[0] == '"' || s[0] == '\\') {
+	dst[0] = '\\';
+	dst[1] = s[0];
+	return 2;
+    }
+    if (s[0] < 0x20 || s[0] == 0x7f) {
+	memcpy(dst, "\\u00", 4);
+	dst[4] = hex[s[0] >> 4];
+	dst[5] = hex[s[0] & 15];
+	return 6;
+    }
+    dst[0] = s[0];
+    return 1;
+}
+
+/*
+ * Write src, escaped but without the surrounding quotes, to dst,
+ * which must have room for JSON_ESCAPE_MAX * strlen(src) bytes.
+ * Returns the number of bytes written; dst is not NUL terminated.
+ */
+size_t json_escape(char *dst, const char *src)
+{
+    char *p = dst;
+
+    while (*src) {
+	p += json_escape_char(p, &src);
+    }
+    return p - dst;
+}
+
+/*
+ * Write s to out as a quoted JSON string.
+ */
+void json_string(FILE *out, const char *s)
+{
+    char buf[JSON_ESCAPE_MAX];
+
+    fputc('"', out);
+    while (*s) {
+	fwrite(buf, 1, json_escape_char(buf, &s), out);
+    }
+    fputc('"', out);
+}
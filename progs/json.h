@@ -0,0 +1,16 @@
+/*
+ * JSON string escaping shared by getcap, setcap and getpcaps.
+ */
+
+#ifndef _PROGS_JSON_H
+#define _PROGS_JSON_H
+
+#include <stdio.h>
+
+/* worst case growth of a byte once escaped */
+#define JSON_ESCAPE_MAX  6
+
+extern size_t json_escape(char *dst, const char *src);
+extern void json_string(FILE *out, const char *s);
+
+#endif /* _PROGS_JSON_H */
@@ -214,6 +214,63 @@ else
 fi
 rm -f nsprivileged
 
+echo "testing setcap --manifest"
+
+# A manifest naming a FIFO must fail for that line without ever
+# opening it: a writer blocked on the FIFO is only released if setcap
+# opens it for reading.
+rm -rf manifest.d
+mkdir manifest.d && touch manifest.d/plain && mkfifo manifest.d/fifo
+cat > manifest.d/list <<EOF
+cap_net_raw=ep manifest.d/plain
+cap_net_raw=ep manifest.d/fifo
+EOF
+( echo x > manifest.d/fifo ) &
+writer=$!
+timeout 10 ./setcap --manifest manifest.d/list
+if [ $? -ne 1 ]; then
+    echo "FAILED to reject the FIFO in a manifest"
+    exit 1
+fi
+./getcap manifest.d/plain | fgrep "cap_net_raw+ep"
+if [ $? -ne 0 ]; then
+    echo "FAILED to apply a manifest"
+    exit 1
+fi
+timeout 10 ./setcap -v --manifest manifest.d/list \
+    | fgrep '"path":"manifest.d/fifo","status":"error"'
+if [ $? -ne 0 ]; then
+    echo "FAILED to report the FIFO in a manifest verification"
+    exit 1
+fi
+sleep 1
+kill -0 $writer
+if [ $? -ne 0 ]; then
+    echo "FAILED setcap opened a FIFO named in a manifest"
+    exit 1
+fi
+cat manifest.d/fifo > /dev/null
+wait $writer
+
+# Filenames with white space are escaped, and bad escapes rejected.
+touch "manifest.d/with space"
+cat > manifest.d/list <<'EOF'
+cap_net_raw=p manifest.d/with\040space
+cap_net_raw=p manifest.d/plain\x
+EOF
+./setcap --manifest manifest.d/list
+if [ $? -ne 1 ]; then
+    echo "FAILED to reject a bad escape in a manifest"
+    exit 1
+fi
+./getcap "manifest.d/with space" | fgrep "cap_net_raw+p"
+if [ $? -ne 0 ]; then
+    echo "FAILED to apply an escaped manifest filename"
+    exit 1
+fi
+rm -rf manifest.d
+echo "PASSED"
+
 # If the build tree compiled the Go cap package.
 if [ -f ../go/compare-cap ]; then
     cp ../go/compare-cap .
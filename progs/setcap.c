@@ -4,20 +4,30 @@
  * This sets/verifies the capabilities of a given file.
  */
 
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/capability.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "json.h"
+
 static void usage(void)
 {
     fprintf(stderr,
 	    "usage: setcap [-q] [-v] [-n <rootid>] (-r|-|<caps>) <filename> "
 	    "[ ... (-r|-|<capsN>) <filenameN> ]\n"
+	    "       setcap [-q] [-v] [-n <rootid>] [-j <n>] --manifest (-|<manifest>)\n"
 	    "\n"
 	    " Note <filename> must be a regular (non-symlink) file.\n"
+	    " Each line of a manifest is \"<caps> <filename>\" or \"-r <filename>\".\n"
+	    " Write a space in <filename> as \\040 and a backslash as \\\\.\n"
 	);
     exit(1);
 }
@@ -56,13 +66,522 @@ static int read_caps(int quiet, const char *filename, char *buffer)
     return (i < MAXCAP ? 0:-1);
 }
 
+/*
+ * Raise the effective CAP_SETFCAP, once. Threads created afterwards
+ * inherit it.
+ */
+static void raise_setfcap(cap_t mycaps)
+{
+    static int tried_to_cap_setfcap = 0;
+    cap_value_t capflag = CAP_SETFCAP;
+
+    if (tried_to_cap_setfcap) {
+	return;
+    }
+    if (cap_set_flag(mycaps, CAP_EFFECTIVE, 1, &capflag, CAP_SET) != 0) {
+	perror("unable to manipulate CAP_SETFCAP - "
+	       "try a newer libcap?");
+	exit(1);
+    }
+    if (cap_set_proc(mycaps) != 0) {
+	perror("unable to set CAP_SETFCAP effective capability");
+	exit(1);
+    }
+    tried_to_cap_setfcap = 1;
+}
+
+/*
+ * The kernel rejects an effective set that is neither empty nor the
+ * union of the permitted and inheritable sets.
+ */
+static int effective_mismatch(cap_t cap_d)
+{
+#ifdef linux
+    uint64_t per, inh, eff;
+
+    return cap_get_mask(cap_d, CAP_PERMITTED, &per) == 0
+	&& cap_get_mask(cap_d, CAP_INHERITABLE, &inh) == 0
+	&& cap_get_mask(cap_d, CAP_EFFECTIVE, &eff) == 0
+	&& (inh | per) != eff;
+#else
+    return 0;
+#endif /* def linux */
+}
+
+static void explain_effective(void)
+{
+    fprintf(stderr, "NOTE: Under Linux, effective file capabilities must either be empty, or\n"
+	    "      exactly match the union of selected permitted and inheritable bits.\n");
+}
+
+/*
+ * Manifest mode applies the lines of a manifest with a pool of
+ * threads. Each file is opened once and its capabilities set through
+ * the descriptor. The status of every line is reported, in manifest
+ * order, once all of them have been applied. With -v, the same pool
+ * verifies the lines instead, see manifest_verify().
+ */
+
+#define MANIFEST_MAX_JOBS  64
+
+struct manifest_line_s {
+    unsigned lineno;
+    char *caps;                  /* NULL to remove capabilities */
+    char *path;
+    int err;                     /* errno of a failure, 0 for success */
+    int unparsed;
+    int explained;
+};
+
+static struct {
+    struct manifest_line_s *lines;
+    size_t count;
+    size_t next;                 /* next line to be claimed */
+    uid_t rootid;
+    int verify;
+    int quiet;
+    int mismatched;              /* set by any verify record but "ok" */
+    pthread_mutex_t out_mu;
+} manifest;
+
+/*
+ * Open a manifest file for cap_get_fd() or cap_set_fd(). The path is
+ * looked at with lstat() first, so that special files are never
+ * opened: anything but a regular file, including a symlink, fails
+ * with EINVAL. Where it cannot be opened, EACCES or EPERM let the
+ * caller fall back to a lookup by path.
+ */
+static int manifest_open(const char *path)
+{
+    struct stat st, fst;
+    int fd, err;
+
+    if (lstat(path, &st) != 0) {
+	return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+	errno = EINVAL;
+	return -1;
+    }
+
+    fd = open(path, O_RDONLY|O_NOFOLLOW|O_NONBLOCK|O_NOCTTY|O_CLOEXEC);
+    if (fd < 0) {
+	if (errno == ELOOP) {
+	    errno = EINVAL;
+	}
+	return -1;
+    }
+    if (fstat(fd, &fst) != 0) {
+	err = errno;
+    } else if (fst.st_dev != st.st_dev || fst.st_ino != st.st_ino) {
+	err = EINVAL;                  /* replaced since the lstat() */
+    } else {
+	return fd;
+    }
+    close(fd);
+    errno = err;
+
+    return -1;
+}
+
+static void manifest_apply(struct manifest_line_s *line)
+{
+    cap_t cap_d = NULL;
+    int fd;
+
+    if (line->caps != NULL) {
+	cap_d = cap_from_text(line->caps);
+	if (cap_d == NULL) {
+	    line->err = errno;
+	    line->unparsed = 1;
+	    return;
+	}
+	cap_set_nsowner(cap_d, manifest.rootid);
+    }
+
+    fd = manifest_open(line->path);
+    if (fd >= 0) {
+	if (cap_set_fd(fd, cap_d) != 0) {
+	    line->err = errno;
+	}
+	close(fd);
+    } else if (errno == EACCES || errno == EPERM) {
+	if (cap_set_file(line->path, cap_d) != 0) {
+	    line->err = errno;
+	}
+    } else {
+	line->err = errno;
+    }
+
+    if (line->err == EINVAL && cap_d != NULL) {
+	line->explained = effective_mismatch(cap_d);
+    }
+    cap_free(cap_d);
+}
+
+/*
+ * Verify mode streams one NDJSON record per manifest line, in the
+ * order the lines complete:
+ *
+ *   {"line":N,"path":"...","status":"ok"}
+ *   {"line":N,"path":"...","status":"differs","flags":"pie",...}
+ *   {"line":N,"path":"...","status":"missing","error":"..."}
+ *   {"line":N,"path":"...","status":"extra","got":"..."}
+ *   {"line":N,"path":"...","status":"error","error":"..."}
+ *
+ * "differs" records carry the wanted and found sets, the capabilities
+ * missing from and extra to the file, and the nsowner of each when
+ * they differ. "extra" is a file carrying capabilities that the
+ * manifest says to remove.
+ */
+
+static void json_caps(FILE *out, const char *key, cap_t caps)
+{
+    char *text = cap_to_text(caps, NULL);
+
+    fprintf(out, ",\"%s\":", key);
+    json_string(out, text == NULL ? "?" : text);
+    cap_free(text);
+}
+
+static void manifest_record(const struct manifest_line_s *line,
+			    const char *status, const char *error,
+			    cap_t want, cap_t got)
+{
+    char *record = NULL;
+    size_t size = 0;
+    FILE *out;
+
+    if (strcmp(status, "ok")) {
+	__atomic_store_n(&manifest.mismatched, 1, __ATOMIC_RELAXED);
+    } else if (manifest.quiet) {
+	return;
+    }
+
+    out = open_memstream(&record, &size);
+    if (out == NULL) {
+	perror("setcap: out of memory");
+	exit(1);
+    }
+    fprintf(out, "{\"line\":%u,\"path\":", line->lineno);
+    json_string(out, line->path);
+    fprintf(out, ",\"status\":\"%s\"", status);
+    if (error != NULL) {
+	fprintf(out, ",\"error\":");
+	json_string(out, error);
+    }
+    if (want != NULL && got != NULL) {
+	int cmp = cap_compare(got, want);
+	uid_t want_rootid = cap_get_nsowner(want);
+	uid_t got_rootid = cap_get_nsowner(got);
+	cap_t missing = cap_dup(want), extra = cap_dup(got);
+
+	fprintf(out, ",\"flags\":\"%s%s%s\"",
+		CAP_DIFFERS(cmp, CAP_PERMITTED) ? "p" : "",
+		CAP_DIFFERS(cmp, CAP_INHERITABLE) ? "i" : "",
+		CAP_DIFFERS(cmp, CAP_EFFECTIVE) ? "e" : "");
+	json_caps(out, "want", want);
+	json_caps(out, "got", got);
+	if (missing != NULL && cap_diff(missing, got) == 0) {
+	    json_caps(out, "missing", missing);
+	}
+	if (extra != NULL && cap_diff(extra, want) == 0) {
+	    json_caps(out, "extra", extra);
+	}
+	if (want_rootid != got_rootid) {
+	    fprintf(out, ",\"rootid\":{\"got\":%u,\"want\":%u}",
+		    got_rootid, want_rootid);
+	}
+	cap_free(missing);
+	cap_free(extra);
+    } else if (got != NULL) {
+	json_caps(out, "got", got);
+    }
+    fputs("}\n", out);
+    if (fclose(out) != 0) {
+	perror("setcap: out of memory");
+	exit(1);
+    }
+
+    pthread_mutex_lock(&manifest.out_mu);
+    fwrite(record, 1, size, stdout);
+    pthread_mutex_unlock(&manifest.out_mu);
+    free(record);
+}
+
+/*
+ * Read the capabilities of a file, the same way manifest_apply()
+ * writes them. A file without capabilities yields NULL with errno
+ * set to ENODATA.
+ */
+static cap_t manifest_get(const char *path)
+{
+    cap_t cap_d;
+    int fd, err;
+
+    fd = manifest_open(path);
+    if (fd < 0) {
+	if (errno == EACCES || errno == EPERM) {
+	    return cap_get_file(path);
+	}
+	return NULL;
+    }
+    cap_d = cap_get_fd(fd);
+    err = errno;
+    close(fd);
+    errno = err;
+
+    return cap_d;
+}
+
+static void manifest_verify(struct manifest_line_s *line)
+{
+    cap_t want = NULL, got;
+
+    if (line->caps != NULL) {
+	want = cap_from_text(line->caps);
+	if (want == NULL) {
+	    manifest_record(line, "error", "unable to parse capabilities",
+			    NULL, NULL);
+	    return;
+	}
+	cap_set_nsowner(want, manifest.rootid);
+    }
+
+    got = manifest_get(line->path);
+    if (got == NULL) {
+	int err = errno;
+
+	if (err == ENOENT || err == ENOTDIR) {
+	    manifest_record(line, "missing", strerror(err), NULL, NULL);
+	} else if (err != ENODATA) {
+	    manifest_record(line, "error", strerror(err), NULL, NULL);
+	} else if (want == NULL) {
+	    manifest_record(line, "ok", NULL, NULL, NULL);
+	} else {
+	    /* as for setcap -v, no capabilities compares as "=" */
+	    got = cap_init();
+	    if (got == NULL) {
+		perror("setcap: out of memory");
+		exit(1);
+	    }
+	}
+    }
+    if (got != NULL) {
+	if (want == NULL) {
+	    manifest_record(line, "extra", NULL, NULL, got);
+	} else if (cap_compare(got, want) != 0
+		   || cap_get_nsowner(got) != cap_get_nsowner(want)) {
+	    manifest_record(line, "differs", NULL, want, got);
+	} else {
+	    manifest_record(line, "ok", NULL, NULL, NULL);
+	}
+    }
+    cap_free(got);
+    cap_free(want);
+}
+
+static void *manifest_worker(void *ignored)
+{
+    for (;;) {
+	size_t i = __atomic_fetch_add(&manifest.next, 1, __ATOMIC_RELAXED);
+
+	if (i >= manifest.count) {
+	    break;
+	}
+	if (manifest.verify) {
+	    manifest_verify(&manifest.lines[i]);
+	} else {
+	    manifest_apply(&manifest.lines[i]);
+	}
+    }
+    return NULL;
+}
+
+/*
+ * Decode, in place, the escapes of a manifest filename: as in fstab(5),
+ * \NNN (three octal digits) stands for that byte, so \040 is a space
+ * and \011 a tab, and \\ for a backslash. Returns -1 for any other
+ * use of a backslash.
+ */
+static int manifest_unescape(char *path)
+{
+    char *to = path;
+
+    for (; *path != '\0'; path++) {
+	if (*path != '\\') {
+	    *to++ = *path;
+	} else if (path[1] == '\\') {
+	    *to++ = *++path;
+	} else if (path[1] >= '0' && path[1] <= '3'
+		   && path[2] >= '0' && path[2] <= '7'
+		   && path[3] >= '0' && path[3] <= '7'
+		   && (path[1] | path[2] | path[3]) != '0') {
+	    *to++ = (path[1] - '0') << 6 | (path[2] - '0') << 3
+		| (path[3] - '0');
+	    path += 3;
+	} else {
+	    return -1;
+	}
+    }
+    *to = '\0';
+    return 0;
+}
+
+/*
+ * Split "<caps> <filename>" at its last run of white space. Returns 1
+ * for a line to act on, 0 for one to skip, -1 if a field is missing
+ * and -2 if the filename is wrongly escaped.
+ */
+static int manifest_parse(struct manifest_line_s *line, char *text)
+{
+    char *end, *path;
+
+    while (*text == ' ' || *text == '\t') {
+	text++;
+    }
+    end = text + strlen(text);
+    while (end > text && (end[-1] == '\n' || end[-1] == '\r'
+			  || end[-1] == ' ' || end[-1] == '\t')) {
+	*--end = '\0';
+    }
+    if (*text == '\0' || *text == '#') {
+	return 0;
+    }
+
+    for (path = end; path > text && path[-1] != ' ' && path[-1] != '\t';
+	 path--);
+    if (path == text) {
+	return -1;
+    }
+    if (manifest_unescape(path) != 0) {
+	return -2;
+    }
+    line->path = strdup(path);
+    for (end = path; end > text && (end[-1] == ' ' || end[-1] == '\t');
+	 *--end = '\0');
+    line->caps = strcmp(text, "-r") ? strdup(text) : NULL;
+    if (line->path == NULL || (line->caps == NULL && strcmp(text, "-r"))) {
+	perror("setcap: out of memory");
+	exit(1);
+    }
+    return 1;
+}
+
+static int do_manifest(const char *source, cap_t mycaps, uid_t rootid,
+		       unsigned jobs, int quiet, int verify)
+{
+    pthread_t threads[MANIFEST_MAX_JOBS];
+    char *text = NULL;
+    size_t size = 0, i;
+    unsigned lineno = 0, started;
+    int failed = 0;
+    FILE *f;
+
+    f = strcmp(source, "-") ? fopen(source, "r") : stdin;
+    if (f == NULL) {
+	fprintf(stderr, "unable to open manifest `%s' (%s)\n", source,
+		strerror(errno));
+	exit(1);
+    }
+
+    memset(&manifest, 0, sizeof(manifest));
+    manifest.rootid = rootid;
+    manifest.verify = verify;
+    manifest.quiet = quiet;
+    pthread_mutex_init(&manifest.out_mu, NULL);
+    while (getline(&text, &size, f) >= 0) {
+	struct manifest_line_s *line;
+	int ret;
+
+	lineno++;
+	if ((manifest.count & (manifest.count + 1)) == 0) {
+	    manifest.lines = realloc(manifest.lines, 2 * (manifest.count + 1)
+				     * sizeof(*manifest.lines));
+	    if (manifest.lines == NULL) {
+		perror("setcap: out of memory");
+		exit(1);
+	    }
+	}
+	line = &manifest.lines[manifest.count];
+	memset(line, 0, sizeof(*line));
+	line->lineno = lineno;
+	ret = manifest_parse(line, text);
+	if (ret == -2) {
+	    fprintf(stderr, "%s:%u: filename escapes are \\NNN (octal)"
+		    " or \\\\\n", source, lineno);
+	    failed = 1;
+	} else if (ret < 0) {
+	    fprintf(stderr, "%s:%u: expected \"<caps> <filename>\"\n",
+		    source, lineno);
+	    failed = 1;
+	} else if (ret > 0) {
+	    manifest.count++;
+	}
+    }
+    free(text);
+    if (f != stdin) {
+	fclose(f);
+    }
+
+    if (manifest.count == 0) {
+	return failed;
+    }
+
+    /* lines commonly share capability texts */
+    cap_text_cache_enable(256);
+    if (!verify) {
+	raise_setfcap(mycaps);
+    }
+
+    if (jobs > manifest.count) {
+	jobs = manifest.count;
+    }
+    for (started = 1; started < jobs; started++) {
+	if (pthread_create(&threads[started], NULL, manifest_worker, NULL)) {
+	    break;
+	}
+    }
+    manifest_worker(NULL);
+    while (--started > 0) {
+	pthread_join(threads[started], NULL);
+    }
+
+    for (i = 0; i < manifest.count; i++) {
+	struct manifest_line_s *line = &manifest.lines[i];
+
+	if (verify) {
+	    /* already reported */
+	} else if (line->unparsed) {
+	    fprintf(stderr, "%s:%u: unable to parse capabilities [%s]\n",
+		    source, line->lineno, line->caps);
+	    failed = 1;
+	} else if (line->err) {
+	    fprintf(stderr, "%s:%u: Failed to set capabilities on file `%s' (%s)\n",
+		    source, line->lineno, line->path, strerror(line->err));
+	    if (line->explained) {
+		explain_effective();
+	    }
+	    failed = 1;
+	} else if (!quiet) {
+	    printf("%s: OK\n", line->path);
+	}
+	free(line->caps);
+	free(line->path);
+    }
+    free(manifest.lines);
+    cap_text_cache_enable(0);
+    fflush(stdout);
+
+    return failed || manifest.mismatched;
+}
+
 int main(int argc, char **argv)
 {
-    int tried_to_cap_setfcap = 0;
     char buffer[MAXCAP+1];
-    int retval, quiet = 0, verify = 0;
+    int retval, quiet = 0, verify = 0, status = 0;
+    unsigned jobs = 0;
     cap_t mycaps;
-    cap_value_t capflag;
     uid_t rootid = 0, f_rootid;
 
     if (argc < 3) {
@@ -100,6 +619,34 @@ int main(int argc, char **argv)
 	    }
 	    continue;
 	}
+	if (!strcmp(*argv, "-j")) {
+	    char *end;
+
+	    if (argc < 2) {
+		usage();
+	    }
+	    --argc;
+	    jobs = strtoul(*++argv, &end, 0);
+	    if (*end || jobs < 1 || jobs > MANIFEST_MAX_JOBS) {
+		fprintf(stderr, "invalid number of jobs '%s'\n", *argv);
+		exit(1);
+	    }
+	    continue;
+	}
+	if (!strcmp(*argv, "--manifest")) {
+	    if (argc < 2) {
+		usage();
+	    }
+	    if (jobs == 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		jobs = cpus < 1 ? 1 :
+		    (cpus > MANIFEST_MAX_JOBS ? MANIFEST_MAX_JOBS : cpus);
+	    }
+	    --argc;
+	    status |= do_manifest(*++argv, mycaps, rootid, jobs, quiet,
+				  verify);
+	    continue;
+	}
 
 	if (!strcmp(*argv, "-r")) {
 	    cap_d = NULL;
@@ -172,48 +719,16 @@ int main(int argc, char **argv)
 		printf("%s: OK\n", *argv);
 	    }
 	} else {
-	    if (!tried_to_cap_setfcap) {
-		capflag = CAP_SETFCAP;
-
-		/*
-		 * Raise the effective CAP_SETFCAP.
-		 */
-		if (cap_set_flag(mycaps, CAP_EFFECTIVE, 1, &capflag, CAP_SET)
-		    != 0) {
-		    perror("unable to manipulate CAP_SETFCAP - "
-			   "try a newer libcap?");
-		    exit(1);
-		}
-		if (cap_set_proc(mycaps) != 0) {
-		    perror("unable to set CAP_SETFCAP effective capability");
-		    exit(1);
-		}
-		tried_to_cap_setfcap = 1;
-	    }
+	    raise_setfcap(mycaps);
 	    retval = cap_set_file(*++argv, cap_d);
 	    if (retval != 0) {
 		int explained = 0;
 		int oerrno = errno;
-#ifdef linux
-		cap_value_t cap;
-		cap_flag_value_t per_state;
-
-		for (cap = 0;
-		     cap_get_flag(cap_d, cap, CAP_PERMITTED, &per_state) != -1;
-		     cap++) {
-		    cap_flag_value_t inh_state, eff_state;
-
-		    cap_get_flag(cap_d, cap, CAP_INHERITABLE, &inh_state);
-		    cap_get_flag(cap_d, cap, CAP_EFFECTIVE, &eff_state);
-		    if ((inh_state | per_state) != eff_state) {
-			fprintf(stderr, "NOTE: Under Linux, effective file capabilities must either be empty, or\n"
-				"      exactly match the union of selected permitted and inheritable bits.\n");
-			explained = 1;
-			break;
-		    }
+
+		if (effective_mismatch(cap_d)) {
+		    explain_effective();
+		    explained = 1;
 		}
-#endif /* def linux */
-		
 		fprintf(stderr,
 			"Failed to set capabilities on file `%s' (%s)\n",
 			argv[0], strerror(oerrno));
@@ -227,5 +742,5 @@ int main(int argc, char **argv)
 	}
     }
 
-    exit(0);
+    exit(status);
 }
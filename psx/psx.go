@@ -1,5 +1,6 @@
 // Package psx provides Go wrappers for two system call functions that
-// work by calling the C libpsx functions of these names.
+// work by calling the C libpsx functions of these names, and for the
+// libpsx batch function, psx_syscall_batch().
 package psx
 
 import (
@@ -35,3 +36,38 @@ func Syscall6(syscallnr, arg1, arg2, arg3, arg4, arg5, arg6 uintptr) (uintptr, u
 	}
 	return uintptr(v), uintptr(v), errno
 }
+
+// Step describes one system call of a Batch.
+type Step struct {
+	Trap uintptr
+	Args [6]uintptr
+}
+
+// Batch performs the steps, in order, on all of the threads of the
+// program in a single round using the libpsx C function
+// psx_syscall_batch(). The batch stops at the first step that fails
+// on the calling thread, after the steps before it have been applied
+// to all of the threads. The return values are the number of steps
+// that succeeded and the error of the step that failed (0 when all
+// of them succeeded).
+func Batch(steps []Step) (int, syscall.Errno) {
+	if len(steps) == 0 {
+		return 0, 0
+	}
+	cs := make([]C.psx_step_t, len(steps))
+	for i, s := range steps {
+		cs[i].syscall_nr = C.long(s.Trap)
+		for j, a := range s.Args {
+			cs[i].arg[j] = C.long(a)
+		}
+	}
+	if C.psx_syscall_batch(&cs[0], C.int(len(cs))) == 0 {
+		return len(cs), 0
+	}
+	for i := range cs {
+		if cs[i].err != 0 {
+			return i, syscall.Errno(cs[i].err)
+		}
+	}
+	return 0, syscall.Errno(C.__errno_too())
+}
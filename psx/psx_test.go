@@ -32,3 +32,21 @@ func TestSyscall6(t *testing.T) {
 		t.Errorf("malformed capget did not return -1, got=%d", got)
 	}
 }
+
+func TestBatch(t *testing.T) {
+	if n, err := Batch(nil); n != 0 || err != 0 {
+		t.Errorf("empty batch returned %d, %v", n, err)
+	}
+	steps := []Step{
+		{Trap: syscall.SYS_GETPID},
+		{Trap: syscall.SYS_GETPID},
+		{Trap: syscall.SYS_CAPGET},
+		{Trap: syscall.SYS_GETPID},
+	}
+	if n, err := Batch(steps[:2]); n != 2 || err != 0 {
+		t.Errorf("getpid batch returned %d, %v", n, err)
+	}
+	if n, err := Batch(steps); n != 2 || err != syscall.EFAULT {
+		t.Errorf("batch with malformed capget returned %d, %v (want 2, %v)", n, err, syscall.EFAULT)
+	}
+}
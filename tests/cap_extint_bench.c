@@ -0,0 +1,127 @@
+/*
+ * Time the decoding of external capability sets with cap_copy_int()
+ * and with cap_copy_int_into() a cap_storage_t. The latter is
+ * expected to neither allocate memory nor make system calls, which
+ * this program checks by wrapping the relevant functions at link
+ * time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/capability.h>
+
+static unsigned long allocs, capgets;
+
+extern void *__real_malloc(size_t);
+extern void *__real_calloc(size_t, size_t);
+extern int __real_capget(cap_user_header_t, cap_user_data_t);
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t n, size_t size);
+int __wrap_capget(cap_user_header_t header, cap_user_data_t data);
+
+void *__wrap_malloc(size_t size)
+{
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    allocs++;
+    return __real_calloc(n, size);
+}
+
+int __wrap_capget(cap_user_header_t header, cap_user_data_t data)
+{
+    capgets++;
+    return __real_capget(header, data);
+}
+
+#define BLOBS 64
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+    static char blobs[BLOBS][128];
+    cap_storage_t storage;
+    unsigned long before_allocs, before_capgets;
+    double start, copy_ns, into_ns;
+    cap_t caps;
+    int i;
+
+    for (i = 0; i < BLOBS; i++) {
+	cap_value_t bit = i % 40;
+
+	caps = cap_init();
+	cap_set_flag(caps, i & 1 ? CAP_PERMITTED : CAP_INHERITABLE,
+		     1, &bit, CAP_SET);
+	if (cap_copy_ext(blobs[i], caps, sizeof(blobs[i])) < 0) {
+	    printf("FAILED to export set %d\n", i);
+	    exit(1);
+	}
+	cap_free(caps);
+    }
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+	caps = cap_copy_int(blobs[i % BLOBS]);
+	if (caps == NULL) {
+	    printf("FAILED cap_copy_int of blob %d\n", i % BLOBS);
+	    exit(1);
+	}
+	cap_free(caps);
+    }
+    copy_ns = (now() - start) / iterations;
+
+    if (allocs < (unsigned long) iterations) {
+	printf("FAILED: allocations are not being counted\n");
+	exit(1);
+    }
+
+    before_allocs = allocs;
+    before_capgets = capgets;
+    start = now();
+    caps = cap_init_storage(&storage);
+    for (i = 0; i < iterations; i++) {
+	if (cap_copy_int_into(caps, blobs[i % BLOBS]) != 0) {
+	    printf("FAILED cap_copy_int_into of blob %d\n", i % BLOBS);
+	    exit(1);
+	}
+    }
+    into_ns = (now() - start) / iterations;
+
+    if (allocs != before_allocs || capgets != before_capgets) {
+	printf("FAILED: cap_copy_int_into made %lu allocations, %lu capgets\n",
+	       allocs - before_allocs, capgets - before_capgets);
+	exit(1);
+    }
+
+    for (i = 0; i < BLOBS; i++) {
+	cap_t expect = cap_copy_int(blobs[i]);
+
+	cap_copy_int_into(caps, blobs[i]);
+	if (expect == NULL || cap_compare(expect, caps)) {
+	    printf("FAILED: decoded sets differ for blob %d\n", i);
+	    exit(1);
+	}
+	cap_free(expect);
+    }
+    if (cap_free(caps) != 0 || cap_free(caps) == 0) {
+	printf("FAILED: cap_free of storage backed set\n");
+	exit(1);
+    }
+
+    printf("cap_copy_int=%.0fns cap_copy_int_into=%.0fns\n", copy_ns, into_ns);
+    printf("%s PASSED\n", argv[0]);
+    exit(0);
+}
@@ -0,0 +1,118 @@
+/*
+ * Check that cap_launch() starts programs, applies the requested
+ * credentials and reports failures from the child.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/capability.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static cap_launch_t launch_sh(const char *script)
+{
+    static const char *argv[] = { "sh", "-c", NULL, NULL };
+    cap_launch_t attr;
+
+    argv[2] = script;
+    attr = cap_new_launcher("/bin/sh", argv, NULL);
+    if (attr == NULL) {
+	perror("cap_new_launcher");
+	exit(1);
+    }
+    return attr;
+}
+
+static int run(cap_launch_t attr)
+{
+    int status;
+    pid_t pid = cap_launch(attr);
+
+    cap_free(attr);
+    if (pid < 0) {
+	return -errno;
+    }
+    if (waitpid(pid, &status, 0) != pid) {
+	perror("waitpid");
+	exit(1);
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *missing[] = { "missing", NULL };
+    const gid_t groups[] = { 65534 };
+    const cap_value_t net_raw = CAP_NET_RAW;
+    cap_launch_t attr;
+    cap_t caps;
+    int failed = 0, ret;
+
+    attr = launch_sh("exit 3");
+    if ((ret = run(attr)) != 3) {
+	printf("FAILED: exit status %d, wanted 3\n", ret);
+	failed = 1;
+    }
+
+    attr = cap_new_launcher("/nonexistent/program", missing, NULL);
+    if ((ret = run(attr)) != -ENOENT) {
+	printf("FAILED: missing program gave %d, wanted %d\n", ret, -ENOENT);
+	failed = 1;
+    }
+
+    if (geteuid() != 0 || !CAP_AMBIENT_SUPPORTED()) {
+	printf("skipping credential tests (not root)\n");
+    } else {
+	attr = launch_sh("test \"$(id -u):$(id -g):$(id -G)\" = 65534:65534:65534 &&"
+		  " grep -q '^CapAmb:.*0000000000002000$' /proc/self/status &&"
+		  " grep -q '^CapBnd:.*[02468ace]$' /proc/self/status");
+	cap_launcher_setgroups(attr, 65534, 1, groups);
+	cap_launcher_setuid(attr, 65534);
+	cap_launcher_set_iab(attr, 1ULL << CAP_NET_RAW, 1ULL << CAP_NET_RAW,
+			     1ULL << CAP_CHOWN);
+	if ((ret = run(attr)) != 0) {
+	    printf("FAILED: credentials not applied (%d)\n", ret);
+	    failed = 1;
+	}
+
+	/*
+	 * Keep CAP_NET_RAW inheritable but drop it from the permitted
+	 * set, so that setting the launched program's inheritable set
+	 * still succeeds and only the ambient raise, which needs the
+	 * capability permitted, can fail.
+	 */
+	caps = cap_get_proc();
+	if (caps == NULL
+	    || cap_set_flag(caps, CAP_INHERITABLE, 1, &net_raw, CAP_SET)
+	    || cap_set_flag(caps, CAP_PERMITTED, 1, &net_raw, CAP_CLEAR)
+	    || cap_set_flag(caps, CAP_EFFECTIVE, 1, &net_raw, CAP_CLEAR)
+	    || cap_set_proc(caps)) {
+	    perror("unable to drop CAP_NET_RAW");
+	    exit(1);
+	}
+	cap_free(caps);
+
+	attr = launch_sh("grep -q '^CapInh:.*0000000000002000$' /proc/self/status");
+	cap_launcher_set_iab(attr, 1ULL << CAP_NET_RAW, 0, 0);
+	if ((ret = run(attr)) != 0) {
+	    printf("FAILED: inheritable set not applied (%d)\n", ret);
+	    failed = 1;
+	}
+
+	attr = launch_sh("exit 0");
+	cap_launcher_set_iab(attr, 1ULL << CAP_NET_RAW, 1ULL << CAP_NET_RAW, 0);
+	if ((ret = run(attr)) != -EPERM) {
+	    printf("FAILED: ambient raise without privilege gave %d, wanted %d\n",
+		   ret, -EPERM);
+	    failed = 1;
+	}
+    }
+
+    if (failed) {
+	exit(1);
+    }
+    printf("PASSED\n");
+    return 0;
+}
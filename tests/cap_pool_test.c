@@ -0,0 +1,114 @@
+/*
+ * Check that the optional cap_t pool reaches a steady state where
+ * allocations are served from the calling thread's own free list, that
+ * the counts of an exited thread are kept, and that a child forked
+ * while another thread churns through the shared depot can still use
+ * the pool.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/capability.h>
+#include <sys/wait.h>
+
+#define DEPOT_SETS 600   /* enough to overflow a thread's own list */
+
+static int stop;
+
+static void churn(int n)
+{
+    static __thread cap_t held[DEPOT_SETS];
+    int i;
+
+    for (i = 0; i < n; i++) {
+	if ((held[i] = cap_init()) == NULL) {
+	    printf("FAILED to allocate a pooled set\n");
+	    exit(1);
+	}
+    }
+    for (i = 0; i < n; i++) {
+	cap_free(held[i]);
+    }
+}
+
+static void *steady(void *ignored)
+{
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+	cap_free(cap_init());
+    }
+    return NULL;
+}
+
+static void *churner(void *ignored)
+{
+    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+	churn(DEPOT_SETS);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    cap_pool_stats_t before, after;
+    pthread_t thread;
+    int i;
+
+    cap_pool_enable(1);
+
+    /* warm up, then a steady state must not grow the pool */
+    churn(1);
+    cap_pool_stats(&before);
+    for (i = 0; i < 1000; i++) {
+	cap_free(cap_init());
+    }
+    cap_pool_stats(&after);
+    if (after.slabs != before.slabs
+	|| after.local - before.local != 1000
+	|| after.in_use != 0) {
+	printf("FAILED steady state: slabs %lu -> %lu, local %lu -> %lu,"
+	       " in use %lu\n", before.slabs, after.slabs,
+	       before.local, after.local, after.in_use);
+	exit(1);
+    }
+
+    /* the counts of another thread are kept when it exits */
+    cap_pool_stats(&before);
+    pthread_create(&thread, NULL, steady, NULL);
+    pthread_join(thread, NULL);
+    cap_pool_stats(&after);
+    if (after.allocs - before.allocs != 1000
+	|| after.frees - before.frees != 1000
+	|| after.local - before.local < 999) {
+	printf("FAILED thread counts: allocs %lu -> %lu, frees %lu -> %lu,"
+	       " local %lu -> %lu\n", before.allocs, after.allocs,
+	       before.frees, after.frees, before.local, after.local);
+	exit(1);
+    }
+
+    /* fork while another thread moves sets to and from the depot */
+    pthread_create(&thread, NULL, churner, NULL);
+    for (i = 0; i < 2000; i++) {
+	int status;
+	pid_t pid = fork();
+
+	if (pid == 0) {
+	    alarm(5);
+	    churn(DEPOT_SETS);
+	    _exit(0);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid
+	    || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	    printf("FAILED forked child %d could not use the pool\n", i);
+	    exit(1);
+	}
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+
+    printf("PASSED\n");
+    return 0;
+}
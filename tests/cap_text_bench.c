@@ -0,0 +1,109 @@
+/*
+ * Time the conversion of capability sets to and from text, the latter
+ * with and without the cap_from_text() cache. Each set is also checked
+ * to survive a round trip through cap_from_text().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/capability.h>
+
+static const char *corpus[] = {
+    "=",
+    "=ep",
+    "cap_chown+ep",
+    "cap_net_raw,cap_net_admin=eip",
+    "all=ep cap_setpcap-e",
+    "all=p cap_kill,cap_sys_admin+e cap_setuid+i",
+    "cap_chown,cap_fowner,cap_sys_ptrace,cap_sys_boot+p cap_mknod=ie",
+    "all=eip",
+    NULL
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double time_from_text(const char *text, int iterations)
+{
+    double start;
+    int i;
+
+    start = now();
+    for (i = 0; i < iterations; i++) {
+	cap_t caps = cap_from_text(text);
+	if (caps == NULL) {
+	    printf("FAILED to parse [%s]\n", text);
+	    exit(1);
+	}
+	cap_free(caps);
+    }
+
+    return (now() - start) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200000;
+    cap_text_cache_stats_t stats;
+    int i, j;
+
+    for (j = 0; corpus[j]; j++) {
+	cap_t caps, back;
+	char buf[1024];
+	char *text;
+	double start, text_ns, text_r_ns, from_ns, cached_ns;
+
+	caps = cap_from_text(corpus[j]);
+	if (caps == NULL) {
+	    printf("FAILED to parse [%s]\n", corpus[j]);
+	    exit(1);
+	}
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+	    text = cap_to_text(caps, NULL);
+	    cap_free(text);
+	}
+	text_ns = (now() - start) / iterations;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+	    cap_to_text_r(caps, buf, sizeof(buf));
+	}
+	text_r_ns = (now() - start) / iterations;
+
+	back = cap_from_text(buf);
+	if (back == NULL || cap_compare(caps, back)) {
+	    printf("FAILED round trip of [%s] via [%s]\n", corpus[j], buf);
+	    exit(1);
+	}
+	cap_free(back);
+	cap_free(caps);
+
+	from_ns = time_from_text(corpus[j], iterations);
+	cap_text_cache_enable(64);
+	cached_ns = time_from_text(corpus[j], iterations);
+	cap_text_cache_enable(0);
+
+	printf("%-66s cap_to_text=%6.0fns cap_to_text_r=%6.0fns"
+	       " cap_from_text=%6.0fns (cached=%6.0fns)\n",
+	       corpus[j], text_ns, text_r_ns, from_ns, cached_ns);
+    }
+
+    cap_text_cache_stats(&stats);
+    if (stats.entries != 0 || stats.misses != j
+	|| stats.hits != (unsigned long) j * (iterations - 1)) {
+	printf("FAILED cache accounting: hits=%lu misses=%lu entries=%lu\n",
+	       stats.hits, stats.misses, stats.entries);
+	exit(1);
+    }
+
+    printf("%s PASSED\n", argv[0]);
+    exit(0);
+}
@@ -0,0 +1,70 @@
+/*
+ * Check that cap_to_text() renders a representative selection of
+ * capability sets as exactly the strings the library has always
+ * produced: empty and full sets, named caps with mixed flags, and
+ * full sets with a few capabilities removed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/capability.h>
+
+static const struct {
+    const char *in, *out;
+} cases[] = {
+    { "=", "=" },
+    { "=ep", "=ep" },
+    { "=p", "=p" },
+    { "all=eip", "=eip" },
+    { "cap_chown+ep", "= cap_chown+ep" },
+    { "cap_chown=i", "= cap_chown+i" },
+    { "cap_chown,cap_kill=eip", "= cap_chown,cap_kill+eip" },
+    { "cap_chown+ep cap_kill+i", "= cap_kill+i cap_chown+ep" },
+    { "cap_net_raw,cap_net_admin+p cap_net_raw+e",
+      "= cap_net_raw+ep cap_net_admin+p" },
+    { "=ep cap_setpcap-e", "=ep cap_setpcap-e" },
+    { "=eip cap_setpcap,cap_sys_admin-i", "=eip cap_setpcap,cap_sys_admin-i" },
+    { "=p cap_chown+i-p", "=p cap_chown+i-p" },
+    { "cap_chown,cap_fowner,cap_sys_ptrace,cap_sys_boot+p cap_mknod=ie",
+      "= cap_mknod+ei cap_chown,cap_fowner,cap_sys_ptrace,cap_sys_boot+p" },
+    { "all=p cap_kill,cap_sys_admin+e cap_setuid+i",
+      "=p cap_setuid+i cap_kill,cap_sys_admin+e" },
+    { "=i cap_setpcap-i", "=i cap_setpcap-i" },
+    { "cap_audit_read+ep", "= cap_audit_read+ep" },
+    { "=e cap_chown-e cap_dac_override+p", "=e cap_dac_override+p cap_chown-e" },
+};
+
+int main(int argc, char **argv)
+{
+    unsigned i;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+	cap_t c = cap_from_text(cases[i].in);
+	char *text;
+
+	if (c == NULL) {
+	    printf("FAILED to parse %s\n", cases[i].in);
+	    exit(1);
+	}
+	text = cap_to_text(c, NULL);
+	if (text == NULL) {
+	    printf("FAILED to render %s\n", cases[i].in);
+	    exit(1);
+	}
+	if (strcmp(text, cases[i].out)) {
+	    printf("FAILED %s: got \"%s\", want \"%s\"\n",
+		   cases[i].in, text, cases[i].out);
+	    failed = 1;
+	}
+	cap_free(text);
+	cap_free(c);
+    }
+    if (failed) {
+	exit(1);
+    }
+
+    printf("PASSED\n");
+    exit(0);
+}
@@ -0,0 +1,231 @@
+/*
+ * Time psx_syscall3() broadcasts against a growing number of threads
+ * parked in one of several states:
+ *
+ *   spin   - busy looping in user space
+ *   read   - blocked in read() on an empty pipe
+ *   futex  - sleeping in FUTEX_WAIT
+ *   masked - mostly running with the psx signal blocked, unblocking
+ *            it for a moment every -m microseconds
+ *
+ * For each thread count, the latency of -n broadcasts of
+ * PR_SET_KEEPCAPS is reported as one CSV line.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/prctl.h>
+#include <sys/psx_syscall.h>
+#include <sys/syscall.h>
+
+#define MAX_THREADS 4096
+#define THREAD_STACK (64 * 1024)
+
+enum state { SPIN, READ, FUTEX, MASKED };
+
+static const char *state_names[] = { "spin", "read", "futex", "masked" };
+
+static enum state state = READ;
+static long mask_us = 1000;
+static int stop, started, futex_word;
+static int pipe_fds[2];
+
+static void *parked(void *arg)
+{
+    char c;
+
+    __atomic_add_fetch(&started, 1, __ATOMIC_RELEASE);
+    switch (state) {
+    case SPIN:
+	while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+	}
+	break;
+    case READ:
+	/* EINTR from each broadcast; 0 once the pipe is closed */
+	while (read(pipe_fds[0], &c, 1) != 0) {
+	}
+	break;
+    case FUTEX:
+	while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+	    syscall(SYS_futex, &futex_word, FUTEX_WAIT_PRIVATE, 0,
+		    NULL, NULL, 0);
+	}
+	break;
+    case MASKED:
+	{
+	    struct timespec delay = {
+		.tv_sec = mask_us / 1000000,
+		.tv_nsec = (mask_us % 1000000) * 1000,
+	    };
+	    sigset_t mask;
+
+	    sigemptyset(&mask);
+	    sigaddset(&mask, PSX_DEFAULT_INTERRUPT);
+	    while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+		pthread_sigmask(SIG_BLOCK, &mask, NULL);
+		nanosleep(&delay, NULL);
+		pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+	    }
+	}
+	break;
+    }
+    return arg;
+}
+
+static void release(pthread_t *threads, int n)
+{
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    switch (state) {
+    case READ:
+	close(pipe_fds[1]);
+	break;
+    case FUTEX:
+	futex_word = 1;
+	syscall(SYS_futex, &futex_word, FUTEX_WAKE_PRIVATE, MAX_THREADS,
+		NULL, NULL, 0);
+	break;
+    default:
+	break;
+    }
+    for (int i = 0; i < n; i++) {
+	pthread_join(threads[i], NULL);
+    }
+    if (state == READ) {
+	close(pipe_fds[0]);
+    }
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+static long now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void measure(int n, int iterations)
+{
+    static pthread_t threads[MAX_THREADS];
+    long *lat = calloc(iterations, sizeof(*lat));
+    pthread_attr_t attr;
+    int i;
+
+    if (lat == NULL) {
+	perror("calloc");
+	exit(1);
+    }
+    stop = 0;
+    started = 0;
+    futex_word = 0;
+    if (state == READ && pipe(pipe_fds) != 0) {
+	perror("pipe");
+	exit(1);
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+    for (i = 0; i < n; i++) {
+	int err = pthread_create(&threads[i], &attr, parked, NULL);
+	if (err) {
+	    fprintf(stderr, "FAILED to start thread %d: %s\n", i,
+		    strerror(err));
+	    exit(1);
+	}
+    }
+    pthread_attr_destroy(&attr);
+    while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) < n) {
+	sched_yield();
+    }
+
+    for (i = 0; i < iterations; i++) {
+	long start = now();
+	if (psx_syscall3(SYS_prctl, PR_SET_KEEPCAPS, i & 1, 0) != 0) {
+	    perror("psx_syscall3");
+	    exit(1);
+	}
+	lat[i] = now() - start;
+    }
+
+    release(threads, n);
+
+    qsort(lat, iterations, sizeof(*lat), compare_ns);
+    printf("%s,%d,%d,%ld,%ld,%ld\n", state_names[state], n, iterations,
+	   lat[iterations / 2], lat[(iterations * 99L) / 100],
+	   lat[iterations - 1]);
+    fflush(stdout);
+    free(lat);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+	    "usage: %s [-s spin|read|futex|masked] [-n iterations]"
+	    " [-m mask-us] [threads ...]\n"
+	    "  (thread counts are 1..%d, default: 1 4 16 64 256 1024 4096)\n",
+	    argv0, MAX_THREADS);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static const int default_counts[] = { 1, 4, 16, 64, 256, 1024, 4096 };
+    int iterations = 100;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "s:n:m:")) != -1) {
+	switch (opt) {
+	case 's':
+	    for (i = 0; i < 4 && strcmp(optarg, state_names[i]); i++) {
+	    }
+	    if (i == 4) {
+		usage(argv[0]);
+	    }
+	    state = i;
+	    break;
+	case 'n':
+	    iterations = atoi(optarg);
+	    if (iterations < 1) {
+		usage(argv[0]);
+	    }
+	    break;
+	case 'm':
+	    mask_us = atol(optarg);
+	    if (mask_us < 1) {
+		usage(argv[0]);
+	    }
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+
+    /* fault in the syscall path before anything is timed */
+    psx_syscall3(SYS_prctl, PR_SET_KEEPCAPS, 0, 0);
+
+    printf("state,threads,iterations,p50_ns,p99_ns,max_ns\n");
+    if (optind == argc) {
+	for (i = 0; i < (int) (sizeof(default_counts) / sizeof(int)); i++) {
+	    measure(default_counts[i], iterations);
+	}
+    }
+    for (i = optind; i < argc; i++) {
+	int n = atoi(argv[i]);
+	if (n < 1 || n > MAX_THREADS) {
+	    usage(argv[0]);
+	}
+	measure(n, iterations);
+    }
+    return 0;
+}
@@ -1,9 +1,14 @@
+#include <errno.h>
+#include <signal.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/prctl.h>
 #include <sys/psx_syscall.h>
 #include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 static void say_hello_expecting(const char *title, int n, int kept) {
     int keeper = prctl(PR_GET_KEEPCAPS);
@@ -50,6 +55,186 @@ static void *say_hello(void *args) {
     return NULL;
 }
 
+#define COMBINERS 8
+#define COMBINED_CALLS 200
+
+static void *combiner(void *args) {
+    for (int i = 0; i < COMBINED_CALLS; i++) {
+	if (i % 10 == 0) {
+	    // A combined failure is reported to its own caller.
+	    if (psx_syscall(SYS_prctl, PR_SET_KEEPCAPS, 2) != -1
+		|| errno != EINVAL) {
+		printf("--> FAILURE combined bad prctl did not fail\n");
+		exit(1);
+	    }
+	} else if (psx_syscall(SYS_prctl, PR_SET_KEEPCAPS, 1) != 0) {
+	    printf("--> FAILURE combined prctl failed\n");
+	    exit(1);
+	}
+    }
+    return NULL;
+}
+
+static void check_combining(void) {
+    pthread_t tid[COMBINERS];
+    psx_stats_t before, after;
+    // Every tenth call fails, and a failed call has nothing of its
+    // own to broadcast.
+    unsigned long calls = COMBINERS * (COMBINED_CALLS - COMBINED_CALLS / 10);
+
+    psx_get_stats(&before);
+    psx_set_combining(1);
+    for (int i = 0; i < COMBINERS; i++) {
+	psx_pthread_create(&tid[i], NULL, combiner, NULL);
+    }
+    for (int i = 0; i < COMBINERS; i++) {
+	pthread_join(tid[i], NULL);
+    }
+    psx_set_combining(0);
+    psx_get_stats(&after);
+
+    // Some of the calls must have shared a broadcast.
+    printf("combined %lu successful calls into %lu broadcasts\n", calls,
+	   after.broadcasts - before.broadcasts);
+    if (after.broadcasts - before.broadcasts >= calls) {
+	printf("--> FAILURE no calls were combined\n");
+	exit(1);
+    }
+    say_hello_expecting("combined", COMBINERS, 1);
+}
+
+#ifdef NOWRAP
+static int registered_fds[2];
+static int registered, registered_self;
+
+static void *self_registering(void *args) {
+    char c;
+
+    while (!__atomic_load_n(&registered, __ATOMIC_ACQUIRE)) {
+	sched_yield();
+    }
+    psx_register(pthread_self());
+    __atomic_store_n(&registered_self, 1, __ATOMIC_RELEASE);
+    while (read(registered_fds[0], &c, 1) != 0) {
+    }
+    say_hello_expecting("registered", 0, 0);
+    return NULL;
+}
+
+/*
+ * A thread registered by another thread, and then by itself, must
+ * keep a single slot, or each broadcast waits for it twice.
+ */
+static void check_register(void) {
+    pthread_t tid;
+    psx_step_t register_step = {
+	.syscall_nr = SYS_prctl, .arg = { PR_SET_KEEPCAPS, 0 }
+    };
+    struct timespec deadline;
+    int nstuck = 0;
+
+    pipe(registered_fds);
+    pthread_create(&tid, NULL, self_registering, NULL);
+    psx_register(tid);
+    __atomic_store_n(&registered, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&registered_self, __ATOMIC_ACQUIRE)) {
+	sched_yield();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += 5;
+    if (psx_syscall_timed(&deadline, &register_step, 1, NULL, &nstuck)) {
+	printf("--> FAILURE broadcast to a twice registered thread"
+	       " (errno=%d)\n", errno);
+	exit(1);
+    }
+    close(registered_fds[1]);
+    pthread_join(tid, NULL);
+    close(registered_fds[0]);
+    say_hello_expecting("registered", 1, 0);
+    psx_syscall(SYS_prctl, PR_SET_KEEPCAPS, 1);
+}
+#endif
+
+static int blocker_fds[2];
+static int blocking, checked;
+
+static void *blocker(void *args) {
+    sigset_t mask;
+    char c;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, PSX_DEFAULT_INTERRUPT);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    __atomic_store_n(&blocking, 1, __ATOMIC_RELEASE);
+    while (read(blocker_fds[0], &c, 1) != 1) {
+    }
+    // The abandoned round's signal is delivered as this returns. It
+    // asked for keepcaps=0, and must be ignored.
+    pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+    say_hello_expecting("unblocked", 0, 1);
+    __atomic_store_n(&checked, 1, __ATOMIC_RELEASE);
+    while (read(blocker_fds[0], &c, 1) != 0) {
+    }
+    say_hello_expecting("unblocked", 1, 0);
+    return NULL;
+}
+
+static void check_timed(void) {
+    pthread_t tid;
+    psx_step_t timed_step = {
+	.syscall_nr = SYS_prctl, .arg = { PR_SET_KEEPCAPS, 0 }
+    };
+    psx_stuck_t stuck[2];
+    int nstuck = 2;
+    psx_stats_t before, after;
+    struct timespec deadline;
+
+    pipe(blocker_fds);
+    psx_pthread_create(&tid, NULL, blocker, NULL);
+    while (!__atomic_load_n(&blocking, __ATOMIC_ACQUIRE)) {
+	sched_yield();
+    }
+    psx_get_stats(&before);
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += 50000000;
+    if (deadline.tv_nsec >= 1000000000) {
+	deadline.tv_sec++;
+	deadline.tv_nsec -= 1000000000;
+    }
+    if (psx_syscall_timed(&deadline, &timed_step, 1, stuck, &nstuck) != -1
+	|| errno != ETIMEDOUT || nstuck != 1
+	|| !pthread_equal(stuck[0].thread, tid) || stuck[0].blocked != 1) {
+	printf("--> FAILURE timed broadcast did not report blocked thread"
+	       " (errno=%d, nstuck=%d)\n", errno, nstuck);
+	exit(1);
+    }
+    printf("stuck thread tid=%d state=%c blocked=%d\n",
+	   stuck[0].tid, stuck[0].state, stuck[0].blocked);
+
+    // The abandoned broadcast must be ignored once the thread
+    // unblocks, and the next one still reach it.
+    write(blocker_fds[1], "x", 1);
+    while (!__atomic_load_n(&checked, __ATOMIC_ACQUIRE)) {
+	sched_yield();
+    }
+    psx_syscall(SYS_prctl, PR_SET_KEEPCAPS, 0);
+    close(blocker_fds[1]);
+    pthread_join(tid, NULL);
+    close(blocker_fds[0]);
+
+    psx_get_stats(&after);
+    if (after.timeouts != before.timeouts + 1
+	|| after.broadcasts != before.broadcasts + 2) {
+	printf("--> FAILURE timed broadcast stats: %lu/%lu -> %lu/%lu\n",
+	       before.broadcasts, before.timeouts,
+	       after.broadcasts, after.timeouts);
+	exit(1);
+    }
+    say_hello_expecting("timed", 0, 0);
+}
+
 int main(int argc, char **argv) {
     pthread_t tid[3];
 
@@ -62,7 +247,24 @@ int main(int argc, char **argv) {
 	step = i;
 	pthread_mutex_unlock(&mu);
 
-	psx_syscall(SYS_prctl, PR_SET_KEEPCAPS, global_kept);
+	if (i & 1) {
+	    // Confirm a batch stops at its first failing step.
+	    psx_step_t steps[4] = {
+		{ .syscall_nr = SYS_prctl, .arg = { PR_SET_KEEPCAPS, 0 } },
+		{ .syscall_nr = SYS_prctl,
+		  .arg = { PR_SET_KEEPCAPS, global_kept } },
+		{ .syscall_nr = SYS_prctl, .arg = { PR_SET_KEEPCAPS, 2 } },
+		{ .syscall_nr = SYS_prctl,
+		  .arg = { PR_SET_KEEPCAPS, !global_kept } },
+	    };
+	    if (psx_syscall_batch(steps, 4) != -1 || errno != EINVAL
+		|| steps[1].err != 0 || steps[2].err != EINVAL) {
+		printf("--> FAILURE batch did not fail at step 2\n");
+		exit(1);
+	    }
+	} else {
+	    psx_syscall(SYS_prctl, PR_SET_KEEPCAPS, global_kept);
+	}
 	step++;
 	pthread_cond_broadcast(&cond);
 
@@ -99,6 +301,12 @@ int main(int argc, char **argv) {
 	}
     }
 
+    check_combining();
+#ifdef NOWRAP
+    check_register();
+#endif
+    check_timed();
+
     printf("%s PASSED\n", argv[0]);
     exit(0);
 }